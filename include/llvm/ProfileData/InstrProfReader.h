@@ -430,6 +430,13 @@ public:
   Error getFunctionCounts(StringRef FuncName, uint64_t FuncHash,
                           std::vector<uint64_t> &Counts);
 
+  /// Look up all the records for FuncName through the on-disk hash table,
+  /// without decoding any other record. Records stays valid until the next
+  /// lookup.
+  Error getRecords(StringRef FuncName, ArrayRef<InstrProfRecord> &Records) {
+    return Index->getRecords(FuncName, Records);
+  }
+
   /// Return the maximum of all known function counts.
   uint64_t getMaximumFunctionCount() { return Summary->getMaxFunctionCount(); }
 
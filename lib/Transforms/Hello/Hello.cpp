@@ -7,11 +7,14 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// This file implements two versions of the LLVM "Hello World" pass described
-// in docs/WritingAnLLVMPass.html
+// This file implements the passes that started out as the LLVM "Hello World"
+// pass described in docs/WritingAnLLVMPass.html: an opcode/type histogram
+// (hello), a function name printer (hello2) and the string compressor (hello3).
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Comdat.h"
@@ -21,46 +24,326 @@
 #include "llvm/IR/GlobalIFunc.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Hello.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/CaptureTracking.h"
+#include <mutex>
+#include <set>
 
 using namespace llvm;
 
 #define DEBUG_TYPE "hello"
 
 STATISTIC(HelloCounter, "Counts number of functions greeted");
+STATISTIC(Hello3Verified, "Number of compressed strings round-tripped by -hello3-verify");
+STATISTIC(Hello3InlineHints, "Number of rewritten functions given an inline hint");
+
+static cl::opt<bool> Hello3Verify(
+	"hello3-verify", cl::init(false),
+	cl::desc("After hello3 rewrites a module, verify it and decode every "
+	         "emitted word index array against the literal it replaced"));
+
+static cl::opt<std::string> HelloOutputFilename(
+	"hello-output", cl::value_desc("filename"),
+	cl::desc("Write hello/hello2 output to this file through a buffered sink "
+	         "instead of stderr"));
 
 namespace {
-  // Hello - The first implementation, without getAnalysisUsage.
-  struct Hello : public FunctionPass {
-    static char ID; // Pass identification, replacement for typeid
-    Hello() : FunctionPass(ID) {
-		initializeHelloPass(*PassRegistry::getPassRegistry());
+  // HelloOutputSink - Collects hello/hello2 output in a buffer per thread and
+  // hands it to the output file in large chunks, so the passes do not pay a
+  // write() per instruction or function and threads never interleave lines.
+  class HelloOutputSink {
+    struct ThreadBuffer {
+      SmallString<0> Data;
+      raw_svector_ostream OS{Data};
+    };
+
+    // Flush a thread's buffer once it grows past this many bytes.
+    static const size_t FlushThreshold = 256 * 1024;
+
+    std::mutex Lock;
+    std::unique_ptr<raw_fd_ostream> File;
+    std::vector<std::unique_ptr<ThreadBuffer>> Buffers;
+    static LLVM_THREAD_LOCAL ThreadBuffer *Current;
+
+    raw_ostream &target() {
+      if (HelloOutputFilename.empty())
+        return errs();
+      if (!File) {
+        std::error_code EC;
+        File = llvm::make_unique<raw_fd_ostream>(HelloOutputFilename, EC,
+                                                 sys::fs::F_Text);
+        if (EC)
+          report_fatal_error("hello: cannot open '" + HelloOutputFilename +
+                             "': " + EC.message());
+      }
+      return *File;
+    }
+
+    // Must be called with Lock held.
+    void write(ThreadBuffer &Buffer) {
+      if (Buffer.Data.empty())
+        return;
+      target() << Buffer.Data;
+      Buffer.Data.clear();
+    }
+
+  public:
+    ~HelloOutputSink() {
+      for (auto &Buffer : Buffers)
+        write(*Buffer);
+      if (File)
+        File->flush();
+    }
+
+    // Returns the calling thread's buffer.
+    raw_ostream &stream() {
+      if (!Current) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Buffers.push_back(llvm::make_unique<ThreadBuffer>());
+        Current = Buffers.back().get();
+      }
+      return Current->OS;
+    }
+
+    // Writes the calling thread's buffer out if it has grown large enough.
+    void flushIfFull() {
+      if (!Current || Current->Data.size() < FlushThreshold)
+        return;
+      std::lock_guard<std::mutex> Guard(Lock);
+      write(*Current);
+    }
+
+    // Writes out whatever the calling thread has buffered.
+    void flush() {
+      if (!Current)
+        return;
+      std::lock_guard<std::mutex> Guard(Lock);
+      write(*Current);
+      target().flush();
+    }
+  };
+}
+
+LLVM_THREAD_LOCAL HelloOutputSink::ThreadBuffer *HelloOutputSink::Current = nullptr;
+
+static ManagedStatic<HelloOutputSink> HelloOutput;
+
+static cl::opt<bool> Hello3InlineHint(
+	"hello3-inline-hint", cl::init(false),
+	cl::desc("Give functions hello3 rewrites an inline hint if they were small "
+	         "enough before the decode sequence was added"));
+
+static cl::opt<unsigned> Hello3InlineHintThreshold(
+	"hello3-inline-hint-threshold", cl::init(16),
+	cl::desc("Largest instruction count, not counting the decode sequences, of "
+	         "a function that -hello3-inline-hint applies to"));
+
+static cl::opt<bool> Hello3Late(
+	"hello3-late", cl::init(false),
+	cl::desc("Add hello3 at the end of the standard optimization pipeline, "
+	         "after the inliner has run"));
+
+enum HelloHistogramFormat { HHF_CSV, HHF_JSON };
+
+static cl::opt<HelloHistogramFormat> HelloFormat(
+	"hello-format", cl::init(HHF_CSV),
+	cl::desc("Output format of the hello pass opcode/type histogram"),
+	cl::values(clEnumValN(HHF_CSV, "csv", "scope,kind,key,count rows for each non-zero bucket"),
+	           clEnumValN(HHF_JSON, "json", "A single JSON object with per-function and module totals")));
+
+static const char *getTypeIDName(Type::TypeID ID) {
+	switch (ID) {
+	case Type::VoidTyID: return "void";
+	case Type::HalfTyID: return "half";
+	case Type::FloatTyID: return "float";
+	case Type::DoubleTyID: return "double";
+	case Type::X86_FP80TyID: return "x86_fp80";
+	case Type::FP128TyID: return "fp128";
+	case Type::PPC_FP128TyID: return "ppc_fp128";
+	case Type::LabelTyID: return "label";
+	case Type::MetadataTyID: return "metadata";
+	case Type::X86_MMXTyID: return "x86_mmx";
+	case Type::TokenTyID: return "token";
+	case Type::IntegerTyID: return "integer";
+	case Type::FunctionTyID: return "function";
+	case Type::StructTyID: return "struct";
+	case Type::ArrayTyID: return "array";
+	case Type::PointerTyID: return "pointer";
+	case Type::VectorTyID: return "vector";
 	}
+	llvm_unreachable("Unknown type ID");
+}
 
-    bool runOnFunction(Function &F) override 
-	{
-		++HelloCounter;
-		for (auto& basicBlock : F)
+// Writes S as the body of a JSON string literal.
+static void writeJSONEscaped(raw_ostream &OS, StringRef S) {
+	for (unsigned char C : S) {
+		if (C == '"' || C == '\\')
+			OS << '\\' << C;
+		else if (C < 0x20)
+			OS << format("\\u%04x", C);
+		else
+			OS << C;
+	}
+}
+
+// Writes S as a CSV field, quoting it only when it needs to be.
+static void writeCSVField(raw_ostream &OS, StringRef S) {
+	if (S.find_first_of(",\"\n\r") == StringRef::npos) {
+		OS << S;
+		return;
+	}
+	OS << '"';
+	for (char C : S) {
+		if (C == '"')
+			OS << '"';
+		OS << C;
+	}
+	OS << '"';
+}
+
+namespace {
+	// Flat opcode and result type counters for one function or a whole module.
+	struct InstHistogram {
+		uint64_t Opcodes[Instruction::OtherOpsEnd] = {};
+		uint64_t Types[Type::VectorTyID + 1] = {};
+
+		void add(const Instruction &I) {
+			++Opcodes[I.getOpcode()];
+			++Types[I.getType()->getTypeID()];
+		}
+
+		void merge(const InstHistogram &Other) {
+			for (unsigned i = 0; i != array_lengthof(Opcodes); ++i)
+				Opcodes[i] += Other.Opcodes[i];
+			for (unsigned i = 0; i != array_lengthof(Types); ++i)
+				Types[i] += Other.Types[i];
+		}
+
+		void writeCSV(raw_ostream &OS, StringRef Scope) const {
+			for (unsigned i = 0; i != array_lengthof(Opcodes); ++i) {
+				if (!Opcodes[i])
+					continue;
+				writeCSVField(OS, Scope);
+				OS << ",opcode," << Instruction::getOpcodeName(i) << ',' << Opcodes[i] << '\n';
+			}
+			for (unsigned i = 0; i != array_lengthof(Types); ++i) {
+				if (!Types[i])
+					continue;
+				writeCSVField(OS, Scope);
+				OS << ",type," << getTypeIDName(Type::TypeID(i)) << ',' << Types[i] << '\n';
+			}
+		}
+
+		void writeJSON(raw_ostream &OS) const {
+			const char *Sep = "";
+			OS << "\"opcodes\":{";
+			for (unsigned i = 0; i != array_lengthof(Opcodes); ++i) {
+				if (!Opcodes[i])
+					continue;
+				OS << Sep << '"' << Instruction::getOpcodeName(i) << "\":" << Opcodes[i];
+				Sep = ",";
+			}
+			Sep = "";
+			OS << "},\"types\":{";
+			for (unsigned i = 0; i != array_lengthof(Types); ++i) {
+				if (!Types[i])
+					continue;
+				OS << Sep << '"' << getTypeIDName(Type::TypeID(i)) << "\":" << Types[i];
+				Sep = ",";
+			}
+			OS << '}';
+		}
+	};
+
+	// Hello - The first implementation. Counts the opcodes and result types of
+	// every instruction, writing one histogram per function as it is visited
+	// and the module-wide totals at the end.
+	struct Hello : public FunctionPass {
+		static char ID; // Pass identification, replacement for typeid
+		Hello() : FunctionPass(ID) {
+			initializeHelloPass(*PassRegistry::getPassRegistry());
+		}
+
+		InstHistogram ModuleTotals;
+		bool FirstFunction = true;
+
+		bool doInitialization(Module &M) override {
+			ModuleTotals = InstHistogram();
+			FirstFunction = true;
+			if (HelloFormat == HHF_CSV)
+				HelloOutput->stream() << "scope,kind,key,count\n";
+			else
+				HelloOutput->stream() << "{\"functions\":[";
+			return false;
+		}
+
+		bool runOnFunction(Function &F) override
 		{
-			for (auto& inst : basicBlock)
+			++HelloCounter;
+			InstHistogram FunctionCounts;
+			for (auto& basicBlock : F)
+			{
+				for (auto& inst : basicBlock)
+				{
+					FunctionCounts.add(inst);
+				}
+			}
+
+			raw_ostream &OS = HelloOutput->stream();
+			if (HelloFormat == HHF_CSV)
+			{
+				FunctionCounts.writeCSV(OS, F.getName());
+			}
+			else
 			{
-				errs() << "Inst: ";
-				errs().write_escaped(inst.getName()) << '\n';
+				OS << (FirstFunction ? "" : ",") << "{\"name\":\"";
+				writeJSONEscaped(OS, F.getName());
+				OS << "\",";
+				FunctionCounts.writeJSON(OS);
+				OS << '}';
 			}
+			HelloOutput->flushIfFull();
+			FirstFunction = false;
+			ModuleTotals.merge(FunctionCounts);
+			return false;
 		}
-		return false;
-    }
-  };
+
+		bool doFinalization(Module &M) override {
+			raw_ostream &OS = HelloOutput->stream();
+			if (HelloFormat == HHF_CSV) {
+				ModuleTotals.writeCSV(OS, "<module>");
+			} else {
+				OS << "],\"module\":{";
+				ModuleTotals.writeJSON(OS);
+				OS << "}}\n";
+			}
+			HelloOutput->flush();
+			return false;
+		}
+
+		// We only count instructions, so every analysis is preserved.
+		void getAnalysisUsage(AnalysisUsage &AU) const override {
+			AU.setPreservesAll();
+		}
+	};
 }
 
 char Hello::ID = 0;
-INITIALIZE_PASS(Hello, "hello", "Hello world pass", false, false);
+INITIALIZE_PASS(Hello, "hello", "Per-function opcode and type histogram", false, true);
 //static RegisterPass<Hello> X("hello", "Hello World Pass", false, false);
 Pass *llvm::createHelloPass() {
 	return new Hello();
@@ -75,7 +358,13 @@ namespace {
     bool runOnFunction(Function &F) override {
       ++HelloCounter;
       //errs() << "Hello: ";
-      errs().write_escaped(F.getName()) << '\n';
+      HelloOutput->stream().write_escaped(F.getName()) << '\n';
+      HelloOutput->flushIfFull();
+      return false;
+    }
+
+    bool doFinalization(Module &M) override {
+      HelloOutput->flush();
       return false;
     }
 
@@ -98,6 +387,37 @@ namespace {
 		std::map<StringRef, unsigned int> wordMap;
 		unsigned int wordIndex = 0;
 
+		// One rewritten use of a string literal, kept for -hello3-verify
+		struct RewrittenString
+		{
+			GlobalVariable* wordIndexVar;
+			unsigned int wordCount;
+			std::string original;
+		};
+		std::vector<RewrittenString> rewrittenStrings;
+
+		// Functions that were given a decode sequence, kept for
+		// -hello3-inline-hint
+		std::set<Function*> rewrittenFunctions;
+
+		// Counts the instructions of F that are not part of a decode sequence,
+		// i.e. the ones not tagged with !hello3.decode
+		static unsigned int countOwnInstructions(const Function &F, unsigned int decodeKind)
+		{
+			unsigned int count = 0;
+			for (auto& bb : F)
+			{
+				for (auto& inst : bb)
+				{
+					if (!inst.getMetadata(decodeKind))
+					{
+						++count;
+					}
+				}
+			}
+			return count;
+		}
+
 		// Splits the string into space-delimited tokens and inserts into wordMap, returning word indices that
 		// are used to call the string lookup function
 		std::vector<unsigned int> getComponentsFromString(StringRef text)
@@ -132,6 +452,8 @@ namespace {
 		bool runOnModule(Module &M) override {
 			bool moduleModified = false;
 			bool removeCurrentGlobal = false;
+			rewrittenStrings.clear();
+			rewrittenFunctions.clear();
 			int currentWordIndex = 0;
 
 			std::vector<StringRef> foundStrings;
@@ -217,6 +539,10 @@ namespace {
 									if (instParent != nullptr)
 									{										
 										errs() << "Building IR\n";
+										if (Hello3InlineHint)
+										{
+											rewrittenFunctions.insert(instParent->getParent());
+										}
 										IRBuilder<> builder(instParent);
 
 										// Create an array to hold the word
@@ -267,6 +593,21 @@ namespace {
 										Value* argListCompressed[3] = { createdRef, wordIndexPtr, ConstantInt::get(IntegerType::getInt32Ty(M.getContext()), wordComponents.size()) };
 										auto callInst = builder.CreateCall(lookupFuncCompressed, argListCompressed);
 
+										// Tag the decode sequence so -hello3-inline-hint can leave it out
+										// of the function's size
+										MDNode* decodeTag = MDNode::get(Ctx, None);
+										allocInst->setMetadata("hello3.decode", decodeTag);
+										callInst->setMetadata("hello3.decode", decodeTag);
+										if (auto refInst = dyn_cast<Instruction>(createdRef))
+										{
+											refInst->setMetadata("hello3.decode", decodeTag);
+										}
+
+										if (Hello3Verify)
+										{
+											rewrittenStrings.push_back({ wordIndexVar, (unsigned int)wordComponents.size(), strData.str() });
+										}
+
 										callInst->dump();
 										instParent->dump();
 
@@ -388,6 +729,27 @@ namespace {
 				/*Name=*/"lookup_table_compressed");
 			compressedLookupTable->setAlignment(4);
 
+			// The decode sequence adds an alloca, a GEP and a call to every
+			// rewritten function, which is enough to push small wrappers over the
+			// inline threshold. Hint the ones that are cheap without it.
+			unsigned int decodeKind = Ctx.getMDKindID("hello3.decode");
+			for (Function* func : rewrittenFunctions)
+			{
+				if (countOwnInstructions(*func, decodeKind) > Hello3InlineHintThreshold ||
+				    func->hasFnAttribute(Attribute::NoInline) ||
+				    func->hasFnAttribute(Attribute::InlineHint))
+				{
+					continue;
+				}
+				func->addFnAttr(Attribute::InlineHint);
+				++Hello3InlineHints;
+			}
+
+			if (Hello3Verify && moduleModified)
+			{
+				verifyRewrittenModule(M, compressedLookupTable);
+			}
+
 			for (NamedMDNode& meta : M.named_metadata())
 			{
 				errs() << meta.getName();
@@ -447,6 +809,86 @@ namespace {
 			return moduleModified;
 		}
 
+		// Runs the IR verifier over the rewritten module, then decodes every
+		// rewritten string from the emitted word index array and word table the
+		// way tableLookupSpace does, joining the words with single spaces, and
+		// compares it to the original literal. Any failure is fatal so a bad
+		// rewrite never reaches codegen.
+		void verifyRewrittenModule(Module &M, GlobalVariable* lookupTable)
+		{
+			if (verifyModule(M, &errs()))
+			{
+				report_fatal_error("hello3-verify: rewritten module failed verification");
+			}
+
+			// Read the words back out of the table rather than from wordMap, so
+			// the check covers what was actually emitted. Empty words and tables
+			// are emitted as zeroinitializer instead of data arrays.
+			std::vector<StringRef> tableWords;
+			if (auto tableData = dyn_cast<ConstantArray>(lookupTable->getInitializer()))
+			{
+				for (auto& op : tableData->operands())
+				{
+					auto wordVar = cast<GlobalVariable>(cast<Constant>(op)->stripPointerCasts());
+					StringRef word;
+					if (auto wordData = dyn_cast<ConstantDataSequential>(wordVar->getInitializer()))
+					{
+						word = wordData->getAsString();
+						word = word.substr(0, word.find('\0'));
+					}
+					tableWords.push_back(word);
+				}
+			}
+
+			unsigned int mismatches = 0;
+			for (auto& rewritten : rewrittenStrings)
+			{
+				// An all-zero index array is also emitted as zeroinitializer
+				Constant* indices = rewritten.wordIndexVar->getInitializer();
+				auto indexType = cast<ArrayType>(indices->getType());
+
+				std::string decoded;
+				bool validIndices = indexType->getNumElements() == rewritten.wordCount;
+				for (unsigned int i = 0; validIndices && i < indexType->getNumElements(); ++i)
+				{
+					uint64_t wordIdx = cast<ConstantInt>(indices->getAggregateElement(i))->getZExtValue();
+					if (wordIdx >= tableWords.size())
+					{
+						validIndices = false;
+						break;
+					}
+					if (i != 0)
+					{
+						decoded += ' ';
+					}
+					decoded += tableWords[wordIdx];
+				}
+
+				if (!validIndices || decoded != rewritten.original)
+				{
+					errs() << "hello3-verify: mismatch for " << rewritten.wordIndexVar->getName()
+					       << "\n  expected: \"";
+					errs().write_escaped(rewritten.original) << "\"\n  decoded:  \"";
+					if (validIndices)
+					{
+						errs().write_escaped(decoded) << "\"\n";
+					}
+					else
+					{
+						errs() << "\" (bad word indices)\n";
+					}
+					++mismatches;
+					continue;
+				}
+				++Hello3Verified;
+			}
+
+			if (mismatches != 0)
+			{
+				report_fatal_error("hello3-verify: " + Twine(mismatches) + " compressed string(s) did not round-trip");
+			}
+		}
+
 		// We don't modify the program, so we preserve all analyses.
 		void getAnalysisUsage(AnalysisUsage &AU) const override {
 			AU.setPreservesAll();
@@ -456,3 +898,15 @@ namespace {
 
 char Hello3::ID = 0;
 static RegisterPass<Hello3> Y("hello3", "String pass", false, false);
+
+// With -hello3-late, run the rewrite once the inliner is done so the decode
+// sequence is placed in the callers and never affects inlining decisions.
+static void addHello3Late(const PassManagerBuilder &Builder,
+                          legacy::PassManagerBase &PM) {
+	if (Hello3Late)
+	{
+		PM.add(new Hello3());
+	}
+}
+
+static RegisterStandardPasses Hello3LateRegistration(PassManagerBuilder::EP_OptimizerLast, addHello3Late);
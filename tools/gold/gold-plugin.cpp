@@ -29,8 +29,10 @@
 #include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
+#include <condition_variable>
 #include <list>
 #include <map>
+#include <mutex>
 #include <plugin-api.h>
 #include <string>
 #include <system_error>
@@ -62,6 +64,7 @@ struct claimed_file {
   void *leader_handle;
   std::vector<ld_plugin_symbol> syms;
   off_t filesize;
+  off_t offset;
   std::string name;
 };
 
@@ -94,6 +97,111 @@ struct ResolutionInfo {
   bool DefaultVisibility = true;
 };
 
+/// Owner of the ThinLTO inputs mapped for the mmap-inputs option. All backend
+/// threads read the same read-only mappings, which are dropped as soon as the
+/// last backend has finished importing: from then on no backend reads input
+/// bitcode again.
+class SharedInputBuffers {
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<MemoryBuffer>> Buffers;
+  unsigned PendingBackends = 0;
+
+public:
+  /// Keep \p Buffer alive until its backend and any that may import from it
+  /// are done with it.
+  void add(std::unique_ptr<MemoryBuffer> Buffer) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Buffers.push_back(std::move(Buffer));
+    ++PendingBackends;
+  }
+
+  /// Called by each backend once it has finished importing.
+  void backendImported() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (PendingBackends && --PendingBackends == 0)
+      Buffers.clear();
+  }
+
+  /// Drop whatever is left, e.g. inputs whose backend was skipped because its
+  /// object was found in the cache.
+  void clear() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Buffers.clear();
+    PendingBackends = 0;
+  }
+};
+
+/// Admission control for ThinLTO backends under the memory-budget option.
+/// Each backend's peak memory is estimated from the size of its bitcode, and a
+/// backend only goes on to optimize and generate code while the estimates of
+/// all admitted backends fit in the budget. A backend whose estimate alone
+/// exceeds the budget is admitted once nothing else is running.
+class BackendMemoryBudget {
+  std::mutex Mutex;
+  std::condition_variable Released;
+  uint64_t Budget = 0;
+  uint64_t InUse = 0;
+  std::vector<uint64_t> Estimates;
+  std::vector<uint64_t> Held;
+
+public:
+  /// Backends typically peak at several times their bitcode size once the
+  /// module is parsed, optimized and handed to the code generator.
+  static const unsigned BitcodeToPeakRatio = 8;
+
+  /// Set the budget and the bitcode size of each ThinLTO task's input, where
+  /// the first ThinLTO task is \p FirstTask.
+  void init(uint64_t BudgetBytes, unsigned FirstTask, unsigned NumTasks,
+            ArrayRef<uint64_t> BitcodeSizes) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Budget = BudgetBytes;
+    Estimates.assign(NumTasks, 0);
+    Held.assign(NumTasks, 0);
+    for (unsigned I = 0, E = BitcodeSizes.size(); I != E; ++I)
+      if (FirstTask + I < NumTasks)
+        Estimates[FirstTask + I] = BitcodeSizes[I] * BitcodeToPeakRatio;
+  }
+
+  /// Block until \p Task fits in the budget.
+  void acquire(unsigned Task) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    if (Task >= Estimates.size() || !Estimates[Task])
+      return;
+    uint64_t Need = Estimates[Task];
+    Released.wait(Lock, [&] { return InUse == 0 || InUse + Need <= Budget; });
+    InUse += Need;
+    Held[Task] = Need;
+  }
+
+  /// Return whatever \p Task holds. Safe to call for tasks that hold nothing.
+  void release(unsigned Task) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      if (Task >= Held.size() || !Held[Task])
+        return;
+      InUse -= Held[Task];
+      Held[Task] = 0;
+    }
+    Released.notify_all();
+  }
+};
+
+/// Output stream for a backend task that returns the task's memory budget
+/// once its object has been written.
+class BudgetedObjectStream : public NativeObjectStream {
+  BackendMemoryBudget &Budget;
+  unsigned Task;
+
+public:
+  BudgetedObjectStream(BackendMemoryBudget &Budget, unsigned Task,
+                       std::unique_ptr<raw_pwrite_stream> OS)
+      : NativeObjectStream(std::move(OS)), Budget(Budget), Task(Task) {}
+  ~BudgetedObjectStream() override {
+    OS.reset();
+    Budget.release(Task);
+  }
+};
+
 }
 
 static ld_plugin_add_symbols add_symbols = nullptr;
@@ -106,6 +214,8 @@ static Optional<Reloc::Model> RelocationModel;
 static std::string output_name = "";
 static std::list<claimed_file> Modules;
 static DenseMap<int, void *> FDToLeaderHandle;
+static SharedInputBuffers MappedInputs;
+static BackendMemoryBudget BackendBudget;
 static StringMap<ResolutionInfo> ResInfo;
 static std::vector<std::string> Cleanup;
 
@@ -174,6 +284,14 @@ namespace options {
   static std::string thinlto_object_suffix_replace;
   // Optional path to a directory for caching ThinLTO objects.
   static std::string cache_dir;
+  // If true, memory-map each claimed input once instead of taking a copy
+  // through gold's get_view, and release the mappings as soon as no backend
+  // can read them anymore. Keeps peak memory down for large ThinLTO links.
+  static bool mmap_inputs = false;
+  // If non-zero, the memory in MiB that in-process ThinLTO backends may use
+  // at once. Backends are admitted by their estimated peak memory, so this,
+  // rather than jobs=, bounds how many run concurrently.
+  static uint64_t memory_budget = 0;
   // Additional options to pass into the code generator.
   // Note: This array will contain all plugin options which are not claimed
   // as plugin exclusive to pass to the code generator.
@@ -222,6 +340,12 @@ namespace options {
                 "thinlto-object-suffix-replace expects 'old;new' format");
     } else if (opt.startswith("cache-dir=")) {
       cache_dir = opt.substr(strlen("cache-dir="));
+    } else if (opt == "mmap-inputs") {
+      mmap_inputs = true;
+    } else if (opt.startswith("memory-budget=")) {
+      if (opt.substr(strlen("memory-budget=")).getAsInteger(10, memory_budget))
+        message(LDPL_FATAL, "Invalid memory budget: %s",
+                opt_ + strlen("memory-budget="));
     } else if (opt.size() == 2 && opt[0] == 'O') {
       if (opt[1] < '0' || opt[1] > '3')
         message(LDPL_FATAL, "Optimization level must be between 0 and 3");
@@ -489,6 +613,7 @@ static ld_plugin_status claim_file_hook(const ld_plugin_input_file *file,
   // Save the filesize since for parallel ThinLTO backends we can only
   // invoke get_input_file once per archive (only for the leader handle).
   cf.filesize = file->filesize;
+  cf.offset = file->offset;
   // In the case of an archive library, all but the first member must have a
   // non-zero offset, which we can append to the file name to obtain a
   // unique name.
@@ -562,14 +687,22 @@ static void freeSymName(ld_plugin_symbol &Sym) {
   Sym.comdat_key = nullptr;
 }
 
-/// Helper to get a file's symbols and a view into it via gold callbacks.
-static const void *getSymbolsAndView(claimed_file &F) {
+/// Helper to get a file's symbols via gold callbacks. Returns false if gold
+/// did not select any of them.
+static bool getSymbols(claimed_file &F) {
   ld_plugin_status status = get_symbols(F.handle, F.syms.size(), F.syms.data());
   if (status == LDPS_NO_SYMS)
-    return nullptr;
+    return false;
 
   if (status != LDPS_OK)
     message(LDPL_FATAL, "Failed to get symbol information");
+  return true;
+}
+
+/// Helper to get a file's symbols and a view into it via gold callbacks.
+static const void *getSymbolsAndView(claimed_file &F) {
+  if (!getSymbols(F))
+    return nullptr;
 
   const void *View;
   if (get_view(F.handle, &View) != LDPS_OK)
@@ -578,6 +711,22 @@ static const void *getSymbolsAndView(claimed_file &F) {
   return View;
 }
 
+/// Helper to get a file's symbols and a read-only mapping of it, reading
+/// through the descriptor \p FD of its leader handle. The mapping stays valid
+/// after the file is released.
+static std::unique_ptr<MemoryBuffer> getSymbolsAndMapping(claimed_file &F,
+                                                          int FD) {
+  if (!getSymbols(F))
+    return nullptr;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+      MemoryBuffer::getOpenFileSlice(FD, F.name, F.filesize, F.offset);
+  if (std::error_code EC = BufferOrErr.getError())
+    message(LDPL_FATAL, "Failed to map %s: %s", F.name.c_str(),
+            EC.message().c_str());
+  return std::move(*BufferOrErr);
+}
+
 /// Parse the thinlto-object-suffix-replace option into the \p OldSuffix and
 /// \p NewSuffix strings, if it was specified.
 static void getThinLTOOldAndNewSuffix(std::string &OldSuffix,
@@ -745,6 +894,22 @@ static std::unique_ptr<LTO> createLTO() {
 
   Conf.DiagHandler = diagnosticHandler;
 
+  if (options::mmap_inputs)
+    Conf.PostImportModuleHook = [](size_t Task, const Module &M) {
+      MappedInputs.backendImported();
+      return true;
+    };
+
+  // The budget is returned when the task's object is written, so only hold it
+  // in modes where every admitted task goes on to produce an object.
+  if (options::memory_budget &&
+      (options::TheOutputType == options::OT_NORMAL ||
+       options::TheOutputType == options::OT_SAVE_TEMPS))
+    Conf.PreOptModuleHook = [](size_t Task, const Module &M) {
+      BackendBudget.acquire(Task);
+      return true;
+    };
+
   switch (options::TheOutputType) {
   case options::OT_NORMAL:
     break;
@@ -832,12 +997,24 @@ static ld_plugin_status allSymbolsReadHook() {
   getThinLTOOldAndNewSuffix(OldSuffix, NewSuffix);
   // Set for owning string objects used as buffer identifiers.
   StringSet<> ObjectFilenames;
+  // Bitcode size of each ThinLTO module, in the order the modules were added
+  // and so the order of their backend tasks.
+  std::vector<uint64_t> ThinLTOInputSizes;
 
   for (claimed_file &F : Modules) {
-    if (options::thinlto && !HandleToInputFile.count(F.leader_handle))
+    if ((options::thinlto || options::mmap_inputs) &&
+        !HandleToInputFile.count(F.leader_handle))
       HandleToInputFile.insert(std::make_pair(
           F.leader_handle, llvm::make_unique<PluginInputFile>(F.handle)));
-    const void *View = getSymbolsAndView(F);
+    std::unique_ptr<MemoryBuffer> Mapping;
+    const void *View;
+    if (options::mmap_inputs) {
+      Mapping = getSymbolsAndMapping(
+          F, HandleToInputFile[F.leader_handle]->file().fd);
+      View = Mapping ? Mapping->getBufferStart() : nullptr;
+    } else {
+      View = getSymbolsAndView(F);
+    }
     // In case we are thin linking with a minimized bitcode file, ensure
     // the module paths encoded in the index reflect where the backends
     // will locate the full bitcode files for compiling/importing.
@@ -853,8 +1030,26 @@ static ld_plugin_status allSymbolsReadHook() {
       continue;
     }
     addModule(*Lto, F, View, ObjFilename.first->first());
+
+    if (!options::mmap_inputs && !options::memory_budget)
+      continue;
+    // A regular LTO module has been linked into the combined module by now,
+    // but ThinLTO backends read theirs, and import from each other's, later.
+    Expected<bool> HasSummary = hasGlobalValueSummary(
+        MemoryBufferRef(StringRef((const char *)View, F.filesize), F.name));
+    if (!HasSummary)
+      consumeError(HasSummary.takeError());
+    if (HasSummary && !*HasSummary)
+      continue;
+    ThinLTOInputSizes.push_back(F.filesize);
+    if (Mapping)
+      MappedInputs.add(std::move(Mapping));
   }
 
+  // The mappings do not need the files to stay open.
+  if (options::mmap_inputs)
+    HandleToInputFile.clear();
+
   SmallString<128> Filename;
   // Note that getOutputFileName will append a unique ID for each task
   if (!options::obj_path.empty())
@@ -864,6 +1059,10 @@ static ld_plugin_status allSymbolsReadHook() {
   bool SaveTemps = !Filename.empty();
 
   size_t MaxTasks = Lto->getMaxTasks();
+  if (options::memory_budget)
+    BackendBudget.init(options::memory_budget << 20,
+                       options::ParallelCodeGenParallelismLevel, MaxTasks,
+                       ThinLTOInputSizes);
   std::vector<uintptr_t> IsTemporary(MaxTasks);
   std::vector<SmallString<128>> Filenames(MaxTasks);
 
@@ -878,11 +1077,13 @@ static ld_plugin_status allSymbolsReadHook() {
     if (EC)
       message(LDPL_FATAL, "Could not open file %s: %s", Filenames[Task].c_str(),
               EC.message().c_str());
-    return llvm::make_unique<lto::NativeObjectStream>(
-        llvm::make_unique<llvm::raw_fd_ostream>(FD, true));
+    return llvm::make_unique<BudgetedObjectStream>(
+        BackendBudget, Task, llvm::make_unique<llvm::raw_fd_ostream>(FD, true));
   };
 
   auto AddBuffer = [&](size_t Task, std::unique_ptr<MemoryBuffer> MB) {
+    // Objects produced on a cache miss arrive here rather than via AddStream.
+    BackendBudget.release(Task);
     // Note that this requires that the memory buffers provided to AddBuffer are
     // backed by a file.
     Filenames[Task] = MB->getBufferIdentifier();
@@ -893,6 +1094,7 @@ static ld_plugin_status allSymbolsReadHook() {
     Cache = check(localCache(options::cache_dir, AddBuffer));
 
   check(Lto->run(AddStream, Cache));
+  MappedInputs.clear();
 
   if (options::TheOutputType == options::OT_DISABLE ||
       options::TheOutputType == options::OT_BC_ONLY)
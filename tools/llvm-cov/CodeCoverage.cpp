@@ -15,6 +15,7 @@
 
 #include "CoverageFilters.h"
 #include "CoverageReport.h"
+#include "CoverageSnapshot.h"
 #include "CoverageSummaryInfo.h"
 #include "CoverageViewOptions.h"
 #include "RenderingSupport.h"
@@ -23,10 +24,13 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include "llvm/ProfileData/Coverage/CoverageMappingReader.h"
 #include "llvm/ProfileData/InstrProfReader.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/Process.h"
@@ -41,9 +45,20 @@ using namespace llvm;
 using namespace coverage;
 
 void exportCoverageDataToJson(const coverage::CoverageMapping &CoverageMapping,
+                              const CoverageViewOptions &Options,
                               raw_ostream &OS);
 
 namespace {
+/// \brief The outcome of writing out a source file view.
+struct SourceFileViewInfo {
+  /// Set once the view is up to date in the output.
+  bool Written = false;
+
+  /// The coverage of the changed lines the view shows, if it is restricted
+  /// to them.
+  LineCoverageInfo ChangedLines;
+};
+
 /// \brief The implementation of the coverage tool.
 class CodeCoverageTool {
 public:
@@ -99,9 +114,20 @@ private:
   /// \brief If a demangler is available, demangle all symbol names.
   void demangleSymbols(const CoverageMapping &Coverage);
 
-  /// \brief Write out a source file view to the filesystem.
+  /// \brief Write out a source file view to the filesystem, showing only
+  /// \p ShownLines if that is not null.
   void writeSourceFileView(StringRef SourceFile, CoverageMapping *Coverage,
-                           CoveragePrinter *Printer, bool ShowFilenames);
+                           CoveragePrinter *Printer, bool ShowFilenames,
+                           const LineRangeList *ShownLines,
+                           SourceFileViewInfo *Info);
+
+  /// \brief Fingerprint everything the view of each source file is rendered
+  /// from, so that a view only has to be written again once its fingerprint
+  /// changes. \p ShownLines is empty or holds the lines to show of each file.
+  std::vector<std::string>
+  fingerprintSourceFileViews(const CoverageMapping &Coverage,
+                             ArrayRef<LineRangeList> ShownLines,
+                             bool ShowFilenames);
 
   typedef llvm::function_ref<int(int, const char **)> CommandLineParserType;
 
@@ -134,6 +160,9 @@ private:
   /// The architecture the coverage mapping data targets.
   std::string CoverageArch;
 
+  /// Where to cache the loaded coverage, if anywhere.
+  std::string SnapshotFilename;
+
   /// A cache for demangled symbols.
   DemangleCache DC;
 
@@ -322,19 +351,99 @@ static bool modifiedTimeGT(StringRef LHS, StringRef RHS) {
   return LHSTime > RHSTime;
 }
 
+/// \brief Load the coverage mapping of \p ObjectFilenames with the counts in
+/// \p ProfileFilename, as CoverageMapping::load does, but read and decode the
+/// coverage mapping sections of the objects on up to \p NumThreads threads.
+/// Only attaching the counts is serial. It sees the objects in the order they
+/// were given, so the result does not depend on the thread count. If
+/// \p Snapshot is not null, everything read is also recorded in it.
+static Expected<std::unique_ptr<CoverageMapping>>
+loadCoverageMapping(ArrayRef<StringRef> ObjectFilenames,
+                    StringRef ProfileFilename, StringRef Arch,
+                    unsigned NumThreads, CoverageSnapshotWriter *Snapshot) {
+  auto ProfileReaderOrErr = IndexedInstrProfReader::create(ProfileFilename);
+  if (Error E = ProfileReaderOrErr.takeError())
+    return std::move(E);
+  auto ProfileReader = std::move(ProfileReaderOrErr.get());
+
+  size_t NumObjects = ObjectFilenames.size();
+  std::vector<std::unique_ptr<MemoryBuffer>> Buffers(NumObjects);
+  std::vector<std::unique_ptr<CoverageMappingReader>> Readers(NumObjects);
+  std::vector<Error> Errors;
+  for (size_t I = 0; I < NumObjects; ++I)
+    Errors.push_back(Error::success());
+
+  auto LoadObject = [&](size_t I) {
+    ErrorAsOutParameter ErrAsOutParam(&Errors[I]);
+    auto BufOrErr = MemoryBuffer::getFileOrSTDIN(ObjectFilenames[I]);
+    if (std::error_code EC = BufOrErr.getError()) {
+      Errors[I] = errorCodeToError(EC);
+      return;
+    }
+    // The reader may replace the buffer, e.g. with a slice of a universal
+    // binary, and refers into it until the mapping has been loaded.
+    Buffers[I] = std::move(BufOrErr.get());
+    auto ReaderOrErr = BinaryCoverageReader::create(Buffers[I], Arch);
+    if (Error E = ReaderOrErr.takeError()) {
+      Errors[I] = std::move(E);
+      return;
+    }
+    Readers[I] = std::move(ReaderOrErr.get());
+  };
+
+  // If NumThreads is not specified, auto-detect a good default.
+  if (NumThreads == 0)
+    NumThreads = std::max(1U, std::min(std::thread::hardware_concurrency(),
+                                       unsigned(NumObjects)));
+
+  if (NumThreads == 1) {
+    for (size_t I = 0; I < NumObjects; ++I)
+      LoadObject(I);
+  } else {
+    ThreadPool Pool(NumThreads);
+    for (size_t I = 0; I < NumObjects; ++I)
+      Pool.async(LoadObject, I);
+    Pool.wait();
+  }
+
+  Error Err = Error::success();
+  for (Error &E : Errors)
+    Err = joinErrors(std::move(Err), std::move(E));
+  if (Err)
+    return std::move(Err);
+
+  if (Snapshot)
+    for (auto &Reader : Readers)
+      Reader = Snapshot->record(std::move(Reader), *ProfileReader);
+  return CoverageMapping::load(Readers, *ProfileReader);
+}
+
 std::unique_ptr<CoverageMapping> CodeCoverageTool::load() {
   for (StringRef ObjectFilename : ObjectFilenames)
     if (modifiedTimeGT(ObjectFilename, PGOFilename))
       warning("profile data may be out of date - object is newer",
               ObjectFilename);
-  auto CoverageOrErr =
-      CoverageMapping::load(ObjectFilenames, PGOFilename, CoverageArch);
-  if (Error E = CoverageOrErr.takeError()) {
-    error("Failed to load coverage: " + toString(std::move(E)),
-          join(ObjectFilenames.begin(), ObjectFilenames.end(), ", "));
-    return nullptr;
+  std::unique_ptr<CoverageMapping> Coverage;
+  if (!SnapshotFilename.empty())
+    Coverage = loadCoverageSnapshot(SnapshotFilename, ObjectFilenames,
+                                    PGOFilename, CoverageArch);
+  if (!Coverage) {
+    CoverageSnapshotWriter Snapshot;
+    auto CoverageOrErr = loadCoverageMapping(
+        ObjectFilenames, PGOFilename, CoverageArch, ViewOpts.NumThreads,
+        SnapshotFilename.empty() ? nullptr : &Snapshot);
+    if (Error E = CoverageOrErr.takeError()) {
+      error("Failed to load coverage: " + toString(std::move(E)),
+            join(ObjectFilenames.begin(), ObjectFilenames.end(), ", "));
+      return nullptr;
+    }
+    Coverage = std::move(CoverageOrErr.get());
+    if (!SnapshotFilename.empty())
+      if (Error E = Snapshot.write(SnapshotFilename, ObjectFilenames,
+                                   PGOFilename, CoverageArch))
+        warning("Could not write coverage snapshot: " + toString(std::move(E)),
+                SnapshotFilename);
   }
-  auto Coverage = std::move(CoverageOrErr.get());
   unsigned Mismatched = Coverage->getMismatchedCount();
   if (Mismatched)
     warning(utostr(Mismatched) + " functions have mismatched data");
@@ -459,12 +568,16 @@ void CodeCoverageTool::demangleSymbols(const CoverageMapping &Coverage) {
 void CodeCoverageTool::writeSourceFileView(StringRef SourceFile,
                                            CoverageMapping *Coverage,
                                            CoveragePrinter *Printer,
-                                           bool ShowFilenames) {
+                                           bool ShowFilenames,
+                                           const LineRangeList *ShownLines,
+                                           SourceFileViewInfo *Info) {
   auto View = createSourceFileView(SourceFile, *Coverage);
   if (!View) {
     warning("The file '" + SourceFile + "' isn't covered.");
     return;
   }
+  if (ShownLines)
+    View->restrictToLines(*ShownLines);
 
   auto OSOrErr = Printer->createViewFile(SourceFile, /*InToplevel=*/false);
   if (Error E = OSOrErr.takeError()) {
@@ -476,6 +589,234 @@ void CodeCoverageTool::writeSourceFileView(StringRef SourceFile,
   View->print(*OS.get(), /*Wholefile=*/true,
               /*ShowSourceName=*/ShowFilenames);
   Printer->closeViewFile(std::move(OS));
+  Info->ChangedLines = View->getShownLineCoverage();
+  Info->Written = true;
+}
+
+std::vector<std::string> CodeCoverageTool::fingerprintSourceFileViews(
+    const CoverageMapping &Coverage, ArrayRef<LineRangeList> ShownLines,
+    bool ShowFilenames) {
+  StringMap<std::string> Stamps;
+  auto WriteStamp = [&](raw_ostream &OS, StringRef Filename) {
+    auto Insertion = Stamps.insert({Filename, ""});
+    if (Insertion.second) {
+      StringRef Path = Filename;
+      auto Loc = RemappedFilenames.find(Filename);
+      if (Loc != RemappedFilenames.end())
+        Path = Loc->second;
+      sys::fs::file_status Status;
+      if (!sys::fs::status(Path, Status))
+        Insertion.first->second =
+            utostr(Status.getSize()) + ":" +
+            utostr(Status.getLastModificationTime().time_since_epoch().count());
+    }
+    OS << Filename << '\0' << Insertion.first->second << '\0';
+  };
+
+  // Everything that changes how a view is rendered, except for the created
+  // time, which changes with every profile even if no count does.
+  SmallString<256> Options;
+  raw_svector_ostream OptionsOS(Options);
+  OptionsOS << unsigned(ViewOpts.Format) << ViewOpts.Colors
+            << ViewOpts.ShowLineNumbers << ViewOpts.ShowLineStats
+            << ViewOpts.ShowRegionMarkers
+            << ViewOpts.ShowLineStatsOrRegionMarkers
+            << ViewOpts.ShowExpandedRegions
+            << ViewOpts.ShowFunctionInstantiations << ShowFilenames << ' '
+            << ViewOpts.TabSize << '\0' << ViewOpts.ProjectTitle << '\0'
+            << LLVM_VERSION_STRING << '\0';
+  for (const std::string &Opt : ViewOpts.DemanglerOpts)
+    OptionsOS << Opt << '\0';
+
+  StringMap<unsigned> FileIndices;
+  std::vector<MD5> Hashes(SourceFiles.size());
+  for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I) {
+    FileIndices[SourceFiles[I]] = I;
+    SmallString<256> Header;
+    raw_svector_ostream OS(Header);
+    OS << Options;
+    WriteStamp(OS, SourceFiles[I]);
+    if (!ShownLines.empty())
+      for (const auto &Range : ShownLines[I])
+        OS << Range.first << '-' << Range.second << ',';
+    Hashes[I].update(OS.str());
+  }
+
+  // Add each function to the views of the files it has regions in. Those
+  // views show it as part of the file, in expansions or as an instantiation.
+  SmallVector<unsigned, 4> Files;
+  SmallString<1024> Record;
+  for (const FunctionRecord &Function : Coverage.getCoveredFunctions()) {
+    Files.clear();
+    for (const CountedRegion &CR : Function.CountedRegions) {
+      auto It = FileIndices.find(Function.Filenames[CR.FileID]);
+      if (It != FileIndices.end() && !is_contained(Files, It->second))
+        Files.push_back(It->second);
+    }
+    if (Files.empty())
+      continue;
+
+    Record.clear();
+    raw_svector_ostream OS(Record);
+    OS << Function.Name << '\0' << Function.ExecutionCount << '\0';
+    for (const std::string &Filename : Function.Filenames)
+      WriteStamp(OS, Filename);
+    for (const CountedRegion &CR : Function.CountedRegions)
+      OS << CR.FileID << ' ' << CR.ExpandedFileID << ' ' << CR.LineStart << ' '
+         << CR.ColumnStart << ' ' << CR.LineEnd << ' ' << CR.ColumnEnd << ' '
+         << unsigned(CR.Kind) << ' ' << CR.ExecutionCount << '\0';
+    for (unsigned I : Files)
+      Hashes[I].update(OS.str());
+  }
+
+  std::vector<std::string> Fingerprints;
+  for (MD5 &Hash : Hashes) {
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    Fingerprints.push_back(Result.digest().str());
+  }
+  return Fingerprints;
+}
+
+/// \brief What -incremental remembers about a view it has written.
+struct ViewManifestEntry {
+  std::string Fingerprint;
+  LineCoverageInfo ChangedLines;
+};
+
+static const char ViewManifestName[] = "manifest";
+static const char ViewManifestHeader[] = "# llvm-cov view manifest v1";
+
+/// \brief Read the manifest at \p Path into \p Entries. A missing or
+/// unreadable manifest leaves them empty, so every view is written again.
+static void readViewManifest(StringRef Path,
+                             StringMap<ViewManifestEntry> &Entries) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (!BufOrErr)
+    return;
+  line_iterator LI(*BufOrErr.get(), /*SkipBlanks=*/true);
+  if (LI.is_at_eof() || *LI != ViewManifestHeader)
+    return;
+  // Each line holds a fingerprint, the covered and mapped changed lines, and
+  // the source file the view is of.
+  for (++LI; !LI.is_at_eof(); ++LI) {
+    StringRef Fingerprint, Covered, NumLines, Filename;
+    std::tie(Fingerprint, Filename) = LI->split(' ');
+    std::tie(Covered, Filename) = Filename.split(' ');
+    std::tie(NumLines, Filename) = Filename.split(' ');
+    size_t CoveredN, NumLinesN;
+    if (Filename.empty() || Covered.getAsInteger(10, CoveredN) ||
+        NumLines.getAsInteger(10, NumLinesN) || CoveredN > NumLinesN)
+      continue;
+    Entries[Filename] = {Fingerprint, LineCoverageInfo(CoveredN, NumLinesN)};
+  }
+}
+
+/// \brief Write the manifest of the views in \p Views that are up to date.
+static Error writeViewManifest(StringRef Path,
+                               ArrayRef<std::string> SourceFiles,
+                               ArrayRef<std::string> Fingerprints,
+                               ArrayRef<SourceFileViewInfo> Views) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_Text);
+  if (EC)
+    return errorCodeToError(EC);
+  OS << ViewManifestHeader << '\n';
+  for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I)
+    if (Views[I].Written)
+      OS << Fingerprints[I] << ' ' << Views[I].ChangedLines.Covered << ' '
+         << Views[I].ChangedLines.NumLines << ' ' << SourceFiles[I] << '\n';
+  OS.close();
+  if (OS.has_error()) {
+    OS.clear_error();
+    return make_error<StringError>("could not write " + Path,
+                                   inconvertibleErrorCode());
+  }
+  return Error::success();
+}
+
+/// \brief Collect the lines each file gains in the unified diff in
+/// \p Filename, such as the output of `git diff`, keyed by the file's path in
+/// the diff.
+static Error readChangedLines(StringRef Filename,
+                              StringMap<LineRangeList> &ChangedLines) {
+  auto BufOrErr = MemoryBuffer::getFileOrSTDIN(Filename);
+  if (std::error_code EC = BufOrErr.getError())
+    return errorCodeToError(EC);
+
+  // Parse a hunk range, "<start>[,<count>]".
+  auto ParseRange = [](StringRef &S, unsigned &Start, unsigned &Count) {
+    if (S.consumeInteger(10, Start))
+      return false;
+    Count = 1;
+    return !S.consume_front(",") || !S.consumeInteger(10, Count);
+  };
+
+  LineRangeList *Ranges = nullptr;
+  unsigned OldLeft = 0, NewLeft = 0, NewLine = 0;
+  for (line_iterator LI(*BufOrErr.get(), /*SkipBlanks=*/false);
+       !LI.is_at_eof(); ++LI) {
+    StringRef Line = *LI;
+    // Inside a hunk, lines only mean what their first character says.
+    if (OldLeft || NewLeft) {
+      if (Line.startswith("+") && NewLeft) {
+        if (Ranges && !Ranges->empty() && Ranges->back().second + 1 == NewLine)
+          Ranges->back().second = NewLine;
+        else if (Ranges)
+          Ranges->push_back({NewLine, NewLine});
+        ++NewLine;
+        --NewLeft;
+      } else if (Line.startswith("-") && OldLeft) {
+        --OldLeft;
+      } else if (!Line.startswith("\\")) {
+        // Context lines are in both versions. Anything else ends the hunk.
+        if (!Line.startswith(" ") || !OldLeft || !NewLeft) {
+          OldLeft = NewLeft = 0;
+          continue;
+        }
+        ++NewLine;
+        --OldLeft;
+        --NewLeft;
+      }
+      continue;
+    }
+
+    if (Line.consume_front("+++ ")) {
+      // Drop any timestamp, and the prefix git gives new files.
+      StringRef Path = Line.split('\t').first;
+      Path.consume_front("b/");
+      Ranges = Path == "/dev/null" ? nullptr : &ChangedLines[Path];
+    } else if (Line.consume_front("@@ -")) {
+      unsigned OldStart;
+      if (!ParseRange(Line, OldStart, OldLeft) || !Line.consume_front(" +") ||
+          !ParseRange(Line, NewLine, NewLeft))
+        return make_error<StringError>("malformed hunk header: " + *LI,
+                                       inconvertibleErrorCode());
+    }
+  }
+
+  // A file may have been in the diff more than once.
+  for (auto &Entry : ChangedLines) {
+    LineRangeList &Lines = Entry.getValue();
+    std::sort(Lines.begin(), Lines.end());
+    LineRangeList Merged;
+    for (const auto &Range : Lines)
+      if (!Merged.empty() && Merged.back().second + 1 >= Range.first)
+        Merged.back().second = std::max(Merged.back().second, Range.second);
+      else
+        Merged.push_back(Range);
+    Lines.swap(Merged);
+  }
+  return Error::success();
+}
+
+/// \brief Check if \p Path names \p SourceFile, relative to some directory
+/// containing it.
+static bool isPathSuffix(StringRef SourceFile, StringRef Path) {
+  if (!SourceFile.endswith(Path))
+    return false;
+  size_t Pos = SourceFile.size() - Path.size();
+  return Pos == 0 || sys::path::is_separator(SourceFile[Pos - 1]);
 }
 
 int CodeCoverageTool::run(Command Cmd, int argc, const char **argv) {
@@ -561,9 +902,21 @@ int CodeCoverageTool::run(Command Cmd, int argc, const char **argv) {
   cl::list<std::string> DemanglerOpts(
       "Xdemangler", cl::desc("<demangler-path>|<demangler-option>"));
 
+  cl::opt<unsigned> NumThreads(
+      "num-threads", cl::init(0),
+      cl::desc("Number of threads to use (default: autodetect)"));
+  cl::alias NumThreadsA("j", cl::desc("Alias for --num-threads"),
+                        cl::aliasopt(NumThreads));
+
+  cl::opt<std::string> Snapshot(
+      "snapshot", cl::value_desc("filename"),
+      cl::desc("Cache the loaded coverage in <filename>, and load it from "
+               "there while the objects, profile and arch are unchanged"));
+
   auto commandLineParser = [&, this](int argc, const char **argv) -> int {
     cl::ParseCommandLineOptions(argc, argv, "LLVM code coverage tool\n");
     ViewOpts.Debug = DebugDump;
+    ViewOpts.NumThreads = NumThreads;
     CompareFilenamesOnly = FilenameEquivalence;
 
     if (!CovFilename.empty())
@@ -637,6 +990,7 @@ int CodeCoverageTool::run(Command Cmd, int argc, const char **argv) {
       return 1;
     }
     CoverageArch = Arch;
+    SnapshotFilename = Snapshot;
 
     for (const std::string &File : InputSourceFiles)
       collectPaths(File);
@@ -705,6 +1059,16 @@ int CodeCoverageTool::show(int argc, const char **argv,
       "project-title", cl::Optional,
       cl::desc("Set project title for the coverage report"));
 
+  cl::opt<bool> Incremental(
+      "incremental", cl::Optional,
+      cl::desc("Only write the views of files whose counts, sources or "
+               "options changed since the last run into the output directory"));
+
+  cl::opt<std::string> ChangedLinesFilename(
+      "changed-lines", cl::value_desc("diff"),
+      cl::desc("Only show the lines added by the unified diff in <diff>, and "
+               "summarize their coverage"));
+
   auto Err = commandLineParser(argc, argv);
   if (Err)
     return Err;
@@ -720,6 +1084,11 @@ int CodeCoverageTool::show(int argc, const char **argv,
   ViewOpts.TabSize = TabSize;
   ViewOpts.ProjectTitle = ProjectTitle;
 
+  if (Incremental && !ViewOpts.hasOutputDirectory()) {
+    error("-incremental requires an output directory.");
+    return 1;
+  }
+
   if (ViewOpts.hasOutputDirectory()) {
     if (auto E = sys::fs::create_directories(ViewOpts.ShowOutputDirectory)) {
       error("Could not create output directory!", E.message());
@@ -782,6 +1151,47 @@ int CodeCoverageTool::show(int argc, const char **argv,
     for (StringRef Filename : Coverage->getUniqueSourceFiles())
       SourceFiles.push_back(Filename);
 
+  // Only show the files with changed lines, and only those lines.
+  std::vector<LineRangeList> ChangedLines;
+  if (!ChangedLinesFilename.empty()) {
+    StringMap<LineRangeList> DiffLines;
+    if (Error E = readChangedLines(ChangedLinesFilename, DiffLines)) {
+      error("Could not read changed lines: " + toString(std::move(E)),
+            ChangedLinesFilename);
+      return 1;
+    }
+    std::vector<std::string> ChangedFiles;
+    for (std::string &SourceFile : SourceFiles)
+      for (const auto &Entry : DiffLines)
+        if (!Entry.getValue().empty() &&
+            isPathSuffix(SourceFile, Entry.getKey())) {
+          ChangedFiles.push_back(std::move(SourceFile));
+          ChangedLines.push_back(Entry.getValue());
+          break;
+        }
+    SourceFiles.swap(ChangedFiles);
+  }
+
+  // Keep the views which are still up to date from the last run.
+  std::vector<SourceFileViewInfo> Views(SourceFiles.size());
+  std::vector<std::string> Fingerprints;
+  SmallString<256> ManifestPath(ViewOpts.ShowOutputDirectory);
+  sys::path::append(ManifestPath, ViewManifestName);
+  if (Incremental) {
+    Fingerprints =
+        fingerprintSourceFileViews(*Coverage, ChangedLines, ShowFilenames);
+    StringMap<ViewManifestEntry> Manifest;
+    readViewManifest(ManifestPath, Manifest);
+    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I) {
+      auto It = Manifest.find(SourceFiles[I]);
+      if (It != Manifest.end() && It->second.Fingerprint == Fingerprints[I] &&
+          Printer->hasViewFile(SourceFiles[I], /*InToplevel=*/false)) {
+        Views[I].Written = true;
+        Views[I].ChangedLines = It->second.ChangedLines;
+      }
+    }
+  }
+
   // Create an index out of the source files.
   if (ViewOpts.hasOutputDirectory()) {
     if (Error E = Printer->createIndexFile(SourceFiles, *Coverage)) {
@@ -791,20 +1201,51 @@ int CodeCoverageTool::show(int argc, const char **argv,
   }
 
   // FIXME: Sink the hardware_concurrency() == 1 check into ThreadPool.
-  if (!ViewOpts.hasOutputDirectory() ||
-      std::thread::hardware_concurrency() == 1) {
-    for (const std::string &SourceFile : SourceFiles)
-      writeSourceFileView(SourceFile, Coverage.get(), Printer.get(),
-                          ShowFilenames);
+  unsigned NumThreads = ViewOpts.NumThreads
+                            ? ViewOpts.NumThreads
+                            : std::thread::hardware_concurrency();
+  auto WriteView = [&](unsigned I) {
+    if (Views[I].Written)
+      return;
+    writeSourceFileView(SourceFiles[I], Coverage.get(), Printer.get(),
+                        ShowFilenames,
+                        ChangedLines.empty() ? nullptr : &ChangedLines[I],
+                        &Views[I]);
+  };
+  if (!ViewOpts.hasOutputDirectory() || NumThreads == 1) {
+    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I)
+      WriteView(I);
   } else {
     // In -output-dir mode, it's safe to use multiple threads to print files.
-    ThreadPool Pool;
-    for (const std::string &SourceFile : SourceFiles)
-      Pool.async(&CodeCoverageTool::writeSourceFileView, this, SourceFile,
-                 Coverage.get(), Printer.get(), ShowFilenames);
+    ThreadPool Pool(NumThreads);
+    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I)
+      Pool.async(WriteView, I);
     Pool.wait();
   }
 
+  if (Incremental)
+    if (Error E = writeViewManifest(ManifestPath, SourceFiles, Fingerprints,
+                                    Views))
+      warning("Could not write view manifest: " + toString(std::move(E)),
+              ManifestPath);
+
+  // Summarize the coverage of the changed lines.
+  if (!ChangedLinesFilename.empty()) {
+    LineCoverageInfo Total;
+    outs() << "\nChanged lines covered:\n";
+    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I) {
+      const LineCoverageInfo &Lines = Views[I].ChangedLines;
+      if (!Lines.NumLines)
+        continue;
+      outs() << SourceFiles[I] << ": " << Lines.Covered << "/"
+             << Lines.NumLines
+             << format(" (%.2f%%)\n", Lines.getPercentCovered());
+      Total += Lines;
+    }
+    outs() << "TOTAL: " << Total.Covered << "/" << Total.NumLines
+           << format(" (%.2f%%)\n", Total.getPercentCovered());
+  }
+
   return 0;
 }
 
@@ -838,10 +1279,17 @@ int CodeCoverageTool::report(int argc, const char **argv,
 int CodeCoverageTool::export_(int argc, const char **argv,
                               CommandLineParserType commandLineParser) {
 
+  cl::opt<bool> SummaryOnly(
+      "summary-only", cl::Optional, cl::init(false),
+      cl::desc("Export only the summaries of files and the totals, without "
+               "segments, expansions or functions"));
+
   auto Err = commandLineParser(argc, argv);
   if (Err)
     return Err;
 
+  ViewOpts.ExportSummaryOnly = SummaryOnly;
+
   if (ViewOpts.Format != CoverageViewOptions::OutputFormat::Text) {
     error("Coverage data can only be exported as textual JSON.");
     return 1;
@@ -853,7 +1301,7 @@ int CodeCoverageTool::export_(int argc, const char **argv,
     return 1;
   }
 
-  exportCoverageDataToJson(*Coverage.get(), outs());
+  exportCoverageDataToJson(*Coverage.get(), ViewOpts, outs());
 
   return 0;
 }
@@ -39,6 +39,12 @@
 // ------ InstantiationCoverage: dict => Object summarizing inst. coverage
 // ------ RegionCoverage: dict => Object summarizing region coverage
 //
+// With -summary-only, the Segments, Expansions and Functions are left out.
+//
+// Every file is written and flushed as soon as it is complete, so the output
+// can be consumed while it is produced and no more than one file's segments
+// are held in memory at a time.
+//
 //===----------------------------------------------------------------------===//
 
 #include "CoverageReport.h"
@@ -63,6 +69,9 @@ class CoverageExporterJson {
   /// \brief The full CoverageMapping object to export.
   const CoverageMapping &Coverage;
 
+  /// \brief The options the export was requested with.
+  const CoverageViewOptions &Options;
+
   /// \brief States that the JSON rendering machine can be in.
   enum JsonState { None, NonEmptyElement, EmptyElement };
 
@@ -73,7 +82,7 @@ class CoverageExporterJson {
   void emitSerialized(const int64_t Value) { OS << Value; }
 
   /// \brief Emit a serialized string.
-  void emitSerialized(const std::string &Value) {
+  void emitSerialized(StringRef Value) {
     OS << "\"";
     for (char C : Value) {
       if (C != '\\')
@@ -103,7 +112,7 @@ class CoverageExporterJson {
   }
 
   /// \brief Emit a dictionary/object key but no value.
-  void emitDictKey(const std::string &Key) {
+  void emitDictKey(StringRef Key) {
     emitComma();
     emitSerialized(Key);
     OS << ":";
@@ -116,7 +125,7 @@ class CoverageExporterJson {
 
   /// \brief Emit a dictionary/object key/value pair.
   template <typename V>
-  void emitDictElement(const std::string &Key, const V &Value) {
+  void emitDictElement(StringRef Key, const V &Value) {
     emitComma();
     emitSerialized(Key);
     OS << ":";
@@ -172,11 +181,14 @@ class CoverageExporterJson {
     for (StringRef SF : Coverage.getUniqueSourceFiles())
       SourceFiles.emplace_back(SF);
     auto FileReports =
-        CoverageReport::prepareFileReports(Coverage, Totals, SourceFiles);
+        CoverageReport::prepareFileReports(Coverage, Totals, SourceFiles,
+                                           Options.NumThreads);
     renderFiles(SourceFiles, FileReports);
 
-    emitDictKey("functions");
-    renderFunctions(Coverage.getCoveredFunctions());
+    if (!Options.ExportSummaryOnly) {
+      emitDictKey("functions");
+      renderFunctions(Coverage.getCoveredFunctions());
+    }
 
     emitDictKey("totals");
     renderSummary(Totals);
@@ -235,50 +247,55 @@ class CoverageExporterJson {
     // Start List of Files.
     emitArrayStart();
 
-    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I) {
-      // Render the file.
-      auto FileCoverage = Coverage.getCoverageForFile(SourceFiles[I]);
-      renderFile(FileCoverage, FileReports[I]);
-    }
+    for (unsigned I = 0, E = SourceFiles.size(); I < E; ++I)
+      renderFile(SourceFiles[I], FileReports[I]);
 
     // End List of Files.
     emitArrayEnd();
   }
 
   /// \brief Render a single file.
-  void renderFile(const CoverageData &FileCoverage,
-                  const FileCoverageSummary &FileReport) {
+  void renderFile(StringRef Filename, const FileCoverageSummary &FileReport) {
     // Start File.
     emitDictStart();
 
-    emitDictElement("filename", FileCoverage.getFilename());
-    emitDictKey("segments");
+    emitDictElement("filename", Filename);
 
-    // Start List of Segments.
-    emitArrayStart();
+    if (!Options.ExportSummaryOnly) {
+      // The segments are only built for as long as the file is rendered.
+      auto FileCoverage = Coverage.getCoverageForFile(Filename);
 
-    for (const auto &Segment : FileCoverage)
-      renderSegment(Segment);
+      emitDictKey("segments");
 
-    // End List of Segments.
-    emitArrayEnd();
+      // Start List of Segments.
+      emitArrayStart();
 
-    emitDictKey("expansions");
+      for (const auto &Segment : FileCoverage)
+        renderSegment(Segment);
 
-    // Start List of Expansions.
-    emitArrayStart();
+      // End List of Segments.
+      emitArrayEnd();
 
-    for (const auto &Expansion : FileCoverage.getExpansions())
-      renderExpansion(Expansion);
+      emitDictKey("expansions");
 
-    // End List of Expansions.
-    emitArrayEnd();
+      // Start List of Expansions.
+      emitArrayStart();
+
+      for (const auto &Expansion : FileCoverage.getExpansions())
+        renderExpansion(Expansion);
+
+      // End List of Expansions.
+      emitArrayEnd();
+    }
 
     emitDictKey("summary");
     renderSummary(FileReport);
 
     // End File.
     emitDictEnd();
+
+    // Hand the finished file to the consumer right away.
+    OS.flush();
   }
 
   /// \brief Render a CoverageSegment.
@@ -403,8 +420,9 @@ class CoverageExporterJson {
   }
 
 public:
-  CoverageExporterJson(const CoverageMapping &CoverageMapping, raw_ostream &OS)
-      : OS(OS), Coverage(CoverageMapping) {
+  CoverageExporterJson(const CoverageMapping &CoverageMapping,
+                       const CoverageViewOptions &Options, raw_ostream &OS)
+      : OS(OS), Coverage(CoverageMapping), Options(Options) {
     State.push(JsonState::None);
   }
 
@@ -414,8 +432,9 @@ public:
 
 /// \brief Export the given CoverageMapping to a JSON Format.
 void exportCoverageDataToJson(const CoverageMapping &CoverageMapping,
+                              const CoverageViewOptions &Options,
                               raw_ostream &OS) {
-  auto Exporter = CoverageExporterJson(CoverageMapping, OS);
+  auto Exporter = CoverageExporterJson(CoverageMapping, Options, OS);
 
   Exporter.print();
 }
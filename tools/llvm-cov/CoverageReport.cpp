@@ -14,9 +14,12 @@
 #include "CoverageReport.h"
 #include "RenderingSupport.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
 #include <numeric>
 
 using namespace llvm;
@@ -165,6 +168,29 @@ unsigned getRedundantPrefixLen(ArrayRef<std::string> Paths) {
   return PrefixLen;
 }
 
+/// \brief Add the coverage of \p Functions, all recorded for one file, to
+/// the file's summary \p Summary.
+void prepareSingleFileReport(
+    ArrayRef<const coverage::FunctionRecord *> Functions,
+    FileCoverageSummary &Summary) {
+  // Map source locations to aggregate function coverage summaries.
+  DenseMap<std::pair<unsigned, unsigned>, FunctionCoverageSummary> Summaries;
+
+  for (const coverage::FunctionRecord *F : Functions) {
+    FunctionCoverageSummary Function = FunctionCoverageSummary::get(*F);
+    auto StartLoc = F->CountedRegions[0].startLoc();
+
+    auto UniquedSummary = Summaries.insert({StartLoc, Function});
+    if (!UniquedSummary.second)
+      UniquedSummary.first->second.update(Function);
+
+    Summary.addInstantiation(Function);
+  }
+
+  for (const auto &UniquedSummary : Summaries)
+    Summary.addFunction(UniquedSummary.second);
+}
+
 } // end anonymous namespace
 
 namespace llvm {
@@ -310,37 +336,49 @@ void CoverageReport::renderFunctionReports(ArrayRef<std::string> Files,
 std::vector<FileCoverageSummary>
 CoverageReport::prepareFileReports(const coverage::CoverageMapping &Coverage,
                                    FileCoverageSummary &Totals,
-                                   ArrayRef<std::string> Files) {
+                                   ArrayRef<std::string> Files,
+                                   unsigned NumThreads) {
   std::vector<FileCoverageSummary> FileReports;
   unsigned LCP = getRedundantPrefixLen(Files);
-
-  for (StringRef Filename : Files) {
-    FileCoverageSummary Summary(Filename.drop_front(LCP));
-
-    // Map source locations to aggregate function coverage summaries.
-    DenseMap<std::pair<unsigned, unsigned>, FunctionCoverageSummary> Summaries;
-
-    for (const auto &F : Coverage.getCoveredFunctions(Filename)) {
-      FunctionCoverageSummary Function = FunctionCoverageSummary::get(F);
-      auto StartLoc = F.CountedRegions[0].startLoc();
-
-      auto UniquedSummary = Summaries.insert({StartLoc, Function});
-      if (!UniquedSummary.second)
-        UniquedSummary.first->second.update(Function);
-
-      Summary.addInstantiation(Function);
-      Totals.addInstantiation(Function);
-    }
-
-    for (const auto &UniquedSummary : Summaries) {
-      const FunctionCoverageSummary &FCS = UniquedSummary.second;
-      Summary.addFunction(FCS);
-      Totals.addFunction(FCS);
-    }
-
-    FileReports.push_back(Summary);
+  for (StringRef Filename : Files)
+    FileReports.emplace_back(Filename.drop_front(LCP));
+
+  // Group the functions by file in one pass, rather than scanning all of
+  // them again for every file.
+  StringMap<std::vector<const coverage::FunctionRecord *>> FunctionsByFile;
+  for (const coverage::FunctionRecord &F : Coverage.getCoveredFunctions())
+    FunctionsByFile[F.Filenames[0]].push_back(&F);
+
+  // Every file is summarized into its own slot, so the reports come out in
+  // the order of Files however the work is scheduled.
+  auto PrepareReport = [&](size_t I) {
+    auto Functions = FunctionsByFile.find(Files[I]);
+    if (Functions != FunctionsByFile.end())
+      prepareSingleFileReport(Functions->second, FileReports[I]);
+  };
+
+  // If NumThreads is not specified, auto-detect a good default.
+  if (NumThreads == 0)
+    NumThreads = std::max(1U, std::min(std::thread::hardware_concurrency(),
+                                       unsigned(Files.size())));
+
+  if (NumThreads == 1) {
+    for (size_t I = 0, E = Files.size(); I < E; ++I)
+      PrepareReport(I);
+  } else {
+    ThreadPool Pool(NumThreads);
+    std::atomic<size_t> NextFile(0);
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Pool.async([&]() {
+        for (size_t File = NextFile++; File < Files.size(); File = NextFile++)
+          PrepareReport(File);
+      });
+    Pool.wait();
   }
 
+  for (const FileCoverageSummary &FCS : FileReports)
+    Totals += FCS;
+
   return FileReports;
 }
 
@@ -354,7 +392,8 @@ void CoverageReport::renderFileReports(raw_ostream &OS) const {
 void CoverageReport::renderFileReports(raw_ostream &OS,
                                        ArrayRef<std::string> Files) const {
   FileCoverageSummary Totals("TOTAL");
-  auto FileReports = prepareFileReports(Coverage, Totals, Files);
+  auto FileReports =
+      prepareFileReports(Coverage, Totals, Files, Options.NumThreads);
 
   std::vector<StringRef> Filenames;
   for (const FileCoverageSummary &FCS : FileReports)
@@ -36,10 +36,12 @@ public:
   void renderFunctionReports(ArrayRef<std::string> Files,
                              const DemangleCache &DC, raw_ostream &OS);
 
-  /// Prepare file reports for the files specified in \p Files.
+  /// Prepare file reports for the files specified in \p Files, in the same
+  /// order, on up to \p NumThreads threads (0 picks a default).
   static std::vector<FileCoverageSummary>
   prepareFileReports(const coverage::CoverageMapping &Coverage,
-                     FileCoverageSummary &Totals, ArrayRef<std::string> Files);
+                     FileCoverageSummary &Totals, ArrayRef<std::string> Files,
+                     unsigned NumThreads);
 
   /// Render file reports for every unique file in the coverage mapping.
   void renderFileReports(raw_ostream &OS) const;
@@ -0,0 +1,522 @@
+//===- CoverageSnapshot.cpp - Snapshots of loaded coverage mappings -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A snapshot starts with a header of little-endian 64-bit fields (see
+// HeaderField) giving the size and position of each table:
+//
+//   Inputs:      name, size and modification time of every object and the
+//                profile the snapshot was made from
+//   Records:     name, hash and table ranges of every mapping record
+//   Filenames:   string table ranges, shared by all records
+//   Expressions: counter expressions as 32-bit fields, shared by all records
+//   Regions:     mapping regions as 32-bit fields, shared by all records
+//   Strings:     all names, deduplicated
+//   Profile:     an indexed profile with the counts of the recorded functions
+//
+//===----------------------------------------------------------------------===//
+
+#include "CoverageSnapshot.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/InstrProfWriter.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+using namespace coverage;
+
+namespace {
+
+/// "lcovsnap" read as a little-endian number.
+const uint64_t SnapshotMagic = 0x70616e73766f636cULL;
+const uint64_t SnapshotVersion = 1;
+
+enum HeaderField {
+  HF_Magic,
+  HF_Version,
+  HF_ArchOffset,
+  HF_ArchSize,
+  HF_NumInputs,
+  HF_InputsOffset,
+  HF_NumRecords,
+  HF_RecordsOffset,
+  HF_NumFilenames,
+  HF_FilenamesOffset,
+  HF_NumExpressions,
+  HF_ExpressionsOffset,
+  HF_NumRegions,
+  HF_RegionsOffset,
+  HF_StringsOffset,
+  HF_StringsSize,
+  HF_ProfileOffset,
+  HF_ProfileSize,
+  HF_NumFields
+};
+
+// The size in bytes of an entry in each table.
+const uint64_t InputEntrySize = 4 * sizeof(uint64_t);
+const uint64_t RecordEntrySize = 9 * sizeof(uint64_t);
+const uint64_t FilenameEntrySize = 2 * sizeof(uint64_t);
+const uint64_t ExpressionEntrySize = 5 * sizeof(uint32_t);
+const uint64_t RegionEntrySize = 9 * sizeof(uint32_t);
+
+/// The state of an input file when the snapshot was made.
+struct InputStamp {
+  StringRef Name;
+  uint64_t Size;
+  uint64_t ModTime;
+};
+
+/// Get the stamps of the objects followed by the profile. Returns false if
+/// any of them cannot be examined, such as standard input.
+bool getInputStamps(ArrayRef<StringRef> ObjectFilenames,
+                    StringRef ProfileFilename,
+                    std::vector<InputStamp> &Stamps) {
+  auto AddStamp = [&](StringRef Name) {
+    sys::fs::file_status Status;
+    if (sys::fs::status(Name, Status))
+      return false;
+    auto ModTime = Status.getLastModificationTime().time_since_epoch();
+    Stamps.push_back({Name, Status.getSize(), uint64_t(ModTime.count())});
+    return true;
+  };
+  for (StringRef Name : ObjectFilenames)
+    if (!AddStamp(Name))
+      return false;
+  return AddStamp(ProfileFilename);
+}
+
+/// Return true if \p Count entries of \p EntrySize bytes starting at
+/// \p Offset fit in \p Limit bytes.
+bool isInBounds(uint64_t Offset, uint64_t Count, uint64_t EntrySize,
+                uint64_t Limit) {
+  return Offset <= Limit && Count <= (Limit - Offset) / EntrySize;
+}
+
+bool decodeCounter(uint32_t Kind, uint32_t ID, Counter &C) {
+  switch (Kind) {
+  case Counter::Zero:
+    C = Counter::getZero();
+    return true;
+  case Counter::CounterValueReference:
+    C = Counter::getCounter(ID);
+    return true;
+  case Counter::Expression:
+    C = Counter::getExpression(ID);
+    return true;
+  }
+  return false;
+}
+
+/// Replays the mapping records of a snapshot. Everything is checked when the
+/// snapshot is opened, so reading the records cannot fail.
+class SnapshotReader : public CoverageMappingReader {
+  StringRef Data;
+  uint64_t Header[HF_NumFields];
+  std::vector<StringRef> FilenameRefs;
+  std::vector<CounterExpression> Expressions;
+  std::vector<CounterMappingRegion> Regions;
+  uint64_t CurrentRecord = 0;
+
+  SnapshotReader(StringRef Data) : Data(Data) {}
+
+  const char *getEntry(HeaderField Table, uint64_t Index,
+                       uint64_t EntrySize) const {
+    return Data.data() + Header[Table] + Index * EntrySize;
+  }
+
+  bool readString(const char *Entry, StringRef &S) const;
+  bool readHeader();
+  bool readRecord(uint64_t Index, CoverageMappingRecord &Record);
+
+public:
+  /// Open the snapshot in \p Data, or return null if it is not valid.
+  static std::unique_ptr<SnapshotReader> create(StringRef Data);
+
+  /// Return true if the snapshot was made for \p Arch from inputs that are
+  /// still in the state given by \p Stamps.
+  bool matches(StringRef Arch, ArrayRef<InputStamp> Stamps) const;
+
+  StringRef getProfileData() const {
+    return Data.substr(Header[HF_ProfileOffset], Header[HF_ProfileSize]);
+  }
+
+  Error readNextRecord(CoverageMappingRecord &Record) override;
+};
+
+} // end anonymous namespace
+
+bool SnapshotReader::readString(const char *Entry, StringRef &S) const {
+  uint64_t Offset = support::endian::read64le(Entry);
+  uint64_t Size = support::endian::read64le(Entry + sizeof(uint64_t));
+  if (!isInBounds(Offset, Size, 1, Header[HF_StringsSize]))
+    return false;
+  S = Data.substr(Header[HF_StringsOffset] + Offset, Size);
+  return true;
+}
+
+bool SnapshotReader::readHeader() {
+  if (Data.size() < HF_NumFields * sizeof(uint64_t))
+    return false;
+  for (unsigned I = 0; I < HF_NumFields; ++I)
+    Header[I] = support::endian::read64le(Data.data() + I * sizeof(uint64_t));
+  if (Header[HF_Magic] != SnapshotMagic ||
+      Header[HF_Version] != SnapshotVersion)
+    return false;
+
+  uint64_t Size = Data.size();
+  return isInBounds(Header[HF_InputsOffset], Header[HF_NumInputs],
+                    InputEntrySize, Size) &&
+         isInBounds(Header[HF_RecordsOffset], Header[HF_NumRecords],
+                    RecordEntrySize, Size) &&
+         isInBounds(Header[HF_FilenamesOffset], Header[HF_NumFilenames],
+                    FilenameEntrySize, Size) &&
+         isInBounds(Header[HF_ExpressionsOffset], Header[HF_NumExpressions],
+                    ExpressionEntrySize, Size) &&
+         isInBounds(Header[HF_RegionsOffset], Header[HF_NumRegions],
+                    RegionEntrySize, Size) &&
+         isInBounds(Header[HF_StringsOffset], Header[HF_StringsSize], 1,
+                    Size) &&
+         isInBounds(Header[HF_ProfileOffset], Header[HF_ProfileSize], 1,
+                    Size) &&
+         isInBounds(Header[HF_ArchOffset], Header[HF_ArchSize], 1,
+                    Header[HF_StringsSize]);
+}
+
+bool SnapshotReader::readRecord(uint64_t Index,
+                                CoverageMappingRecord &Record) {
+  using support::endian::read32le;
+  using support::endian::read64le;
+
+  const char *Entry = getEntry(HF_RecordsOffset, Index, RecordEntrySize);
+  uint64_t Fields[9];
+  for (unsigned I = 0; I < 9; ++I)
+    Fields[I] = read64le(Entry + I * sizeof(uint64_t));
+  uint64_t FilenamesBegin = Fields[3], NumFilenames = Fields[4];
+  uint64_t ExpressionsBegin = Fields[5], NumExpressions = Fields[6];
+  uint64_t RegionsBegin = Fields[7], NumRegions = Fields[8];
+  if (!readString(Entry, Record.FunctionName) ||
+      !isInBounds(FilenamesBegin, NumFilenames, 1, FilenameRefs.size()) ||
+      !isInBounds(ExpressionsBegin, NumExpressions, 1,
+                  Header[HF_NumExpressions]) ||
+      !isInBounds(RegionsBegin, NumRegions, 1, Header[HF_NumRegions]))
+    return false;
+  Record.FunctionHash = Fields[2];
+  Record.Filenames =
+      makeArrayRef(FilenameRefs).slice(FilenamesBegin, NumFilenames);
+
+  Expressions.clear();
+  for (uint64_t I = 0; I < NumExpressions; ++I) {
+    const char *E =
+        getEntry(HF_ExpressionsOffset, ExpressionsBegin + I,
+                 ExpressionEntrySize);
+    uint32_t Kind = read32le(E);
+    Counter LHS, RHS;
+    if (Kind > CounterExpression::Add ||
+        !decodeCounter(read32le(E + 4), read32le(E + 8), LHS) ||
+        !decodeCounter(read32le(E + 12), read32le(E + 16), RHS))
+      return false;
+    Expressions.emplace_back(CounterExpression::ExprKind(Kind), LHS, RHS);
+  }
+
+  Regions.clear();
+  for (uint64_t I = 0; I < NumRegions; ++I) {
+    const char *R =
+        getEntry(HF_RegionsOffset, RegionsBegin + I, RegionEntrySize);
+    uint32_t Fields[9];
+    for (unsigned J = 0; J < 9; ++J)
+      Fields[J] = read32le(R + J * sizeof(uint32_t));
+    Counter Count;
+    uint32_t FileID = Fields[2], ExpandedFileID = Fields[3];
+    uint32_t Kind = Fields[8];
+    if (!decodeCounter(Fields[0], Fields[1], Count) ||
+        Kind > CounterMappingRegion::SkippedRegion || FileID >= NumFilenames ||
+        (Kind == CounterMappingRegion::ExpansionRegion &&
+         ExpandedFileID >= NumFilenames))
+      return false;
+    Regions.emplace_back(Count, FileID, ExpandedFileID, Fields[4], Fields[5],
+                         Fields[6], Fields[7],
+                         CounterMappingRegion::RegionKind(Kind));
+  }
+
+  Record.Expressions = Expressions;
+  Record.MappingRegions = Regions;
+  return true;
+}
+
+std::unique_ptr<SnapshotReader> SnapshotReader::create(StringRef Data) {
+  std::unique_ptr<SnapshotReader> Reader(new SnapshotReader(Data));
+  if (!Reader->readHeader())
+    return nullptr;
+
+  Reader->FilenameRefs.resize(Reader->Header[HF_NumFilenames]);
+  for (uint64_t I = 0, E = Reader->FilenameRefs.size(); I < E; ++I)
+    if (!Reader->readString(
+            Reader->getEntry(HF_FilenamesOffset, I, FilenameEntrySize),
+            Reader->FilenameRefs[I]))
+      return nullptr;
+
+  // Check every record up front: CoverageMapping::load has no way to deal
+  // with a bad one.
+  CoverageMappingRecord Record;
+  for (uint64_t I = 0, E = Reader->Header[HF_NumRecords]; I < E; ++I)
+    if (!Reader->readRecord(I, Record))
+      return nullptr;
+  return Reader;
+}
+
+bool SnapshotReader::matches(StringRef Arch,
+                             ArrayRef<InputStamp> Stamps) const {
+  StringRef SnapshotArch = Data.substr(
+      Header[HF_StringsOffset] + Header[HF_ArchOffset], Header[HF_ArchSize]);
+  if (SnapshotArch != Arch || Header[HF_NumInputs] != Stamps.size())
+    return false;
+  for (uint64_t I = 0, E = Stamps.size(); I < E; ++I) {
+    const char *Entry = getEntry(HF_InputsOffset, I, InputEntrySize);
+    StringRef Name;
+    if (!readString(Entry, Name) || Name != Stamps[I].Name ||
+        support::endian::read64le(Entry + 16) != Stamps[I].Size ||
+        support::endian::read64le(Entry + 24) != Stamps[I].ModTime)
+      return false;
+  }
+  return true;
+}
+
+Error SnapshotReader::readNextRecord(CoverageMappingRecord &Record) {
+  if (CurrentRecord == Header[HF_NumRecords])
+    return make_error<CoverageMapError>(coveragemap_error::eof);
+  bool Valid = readRecord(CurrentRecord++, Record);
+  assert(Valid && "Snapshot records are checked when it is opened");
+  (void)Valid;
+  return Error::success();
+}
+
+std::unique_ptr<CoverageMapping>
+llvm::loadCoverageSnapshot(StringRef Path, ArrayRef<StringRef> ObjectFilenames,
+                           StringRef ProfileFilename, StringRef Arch) {
+  std::vector<InputStamp> Stamps;
+  if (!getInputStamps(ObjectFilenames, ProfileFilename, Stamps))
+    return nullptr;
+
+  auto BufOrErr =
+      MemoryBuffer::getFile(Path, /*FileSize=*/-1,
+                            /*RequiresNullTerminator=*/false);
+  if (!BufOrErr)
+    return nullptr;
+  std::unique_ptr<MemoryBuffer> Buffer = std::move(BufOrErr.get());
+  auto Reader = SnapshotReader::create(Buffer->getBuffer());
+  if (!Reader || !Reader->matches(Arch, Stamps))
+    return nullptr;
+
+  auto ProfileReaderOrErr = IndexedInstrProfReader::create(
+      MemoryBuffer::getMemBuffer(Reader->getProfileData(), Path,
+                                 /*RequiresNullTerminator=*/false));
+  if (Error E = ProfileReaderOrErr.takeError()) {
+    consumeError(std::move(E));
+    return nullptr;
+  }
+  auto CoverageOrErr =
+      CoverageMapping::load(*Reader, *ProfileReaderOrErr.get());
+  if (Error E = CoverageOrErr.takeError()) {
+    consumeError(std::move(E));
+    return nullptr;
+  }
+  return std::move(CoverageOrErr.get());
+}
+
+namespace {
+
+/// Passes on the records of another reader, adding each to a snapshot.
+class RecordingReader : public CoverageMappingReader {
+  std::unique_ptr<CoverageMappingReader> Reader;
+  CoverageSnapshotWriter &Snapshot;
+  IndexedInstrProfReader &ProfileReader;
+
+public:
+  RecordingReader(std::unique_ptr<CoverageMappingReader> Reader,
+                  CoverageSnapshotWriter &Snapshot,
+                  IndexedInstrProfReader &ProfileReader)
+      : Reader(std::move(Reader)), Snapshot(Snapshot),
+        ProfileReader(ProfileReader) {}
+
+  Error readNextRecord(CoverageMappingRecord &Record) override {
+    if (Error E = Reader->readNextRecord(Record))
+      return E;
+    Snapshot.addRecord(Record, ProfileReader);
+    return Error::success();
+  }
+};
+
+} // end anonymous namespace
+
+std::unique_ptr<CoverageMappingReader>
+CoverageSnapshotWriter::record(std::unique_ptr<CoverageMappingReader> Reader,
+                               IndexedInstrProfReader &ProfileReader) {
+  if (!ProfileErr)
+    ProfileErr = Profile.setIsIRLevelProfile(ProfileReader.isIRLevelProfile());
+  return llvm::make_unique<RecordingReader>(std::move(Reader), *this,
+                                            ProfileReader);
+}
+
+CoverageSnapshotWriter::StringEntry
+CoverageSnapshotWriter::addString(StringRef S) {
+  auto Inserted = StringEntries.insert({S, {Strings.size(), S.size()}});
+  if (Inserted.second)
+    Strings += S;
+  return Inserted.first->second;
+}
+
+void CoverageSnapshotWriter::addRecord(const CoverageMappingRecord &Record,
+                                       IndexedInstrProfReader &ProfileReader) {
+  // Keep the counts of every function under all of its hashes, so that
+  // loading the snapshot finds the same mismatches.
+  bool NewFunction = !StringEntries.count(Record.FunctionName);
+  ArrayRef<InstrProfRecord> Counts;
+  if (NewFunction && !ProfileErr) {
+    if (Error E = ProfileReader.getRecords(Record.FunctionName, Counts))
+      // A function without counts gets zero counts on every load anyway.
+      consumeError(std::move(E));
+    for (InstrProfRecord Count : Counts)
+      if ((ProfileErr = Profile.addRecord(std::move(Count))))
+        break;
+  }
+
+  RecordEntry Entry;
+  Entry.Name = addString(Record.FunctionName);
+  Entry.Hash = Record.FunctionHash;
+  Entry.FilenamesBegin = Filenames.size();
+  Entry.NumFilenames = Record.Filenames.size();
+  for (StringRef Filename : Record.Filenames)
+    Filenames.push_back(addString(Filename));
+  Entry.ExpressionsBegin = Expressions.size();
+  Entry.NumExpressions = Record.Expressions.size();
+  Expressions.insert(Expressions.end(), Record.Expressions.begin(),
+                     Record.Expressions.end());
+  Entry.RegionsBegin = Regions.size();
+  Entry.NumRegions = Record.MappingRegions.size();
+  Regions.insert(Regions.end(), Record.MappingRegions.begin(),
+                 Record.MappingRegions.end());
+  Records.push_back(Entry);
+}
+
+Error CoverageSnapshotWriter::write(StringRef Path,
+                                   ArrayRef<StringRef> ObjectFilenames,
+                                   StringRef ProfileFilename, StringRef Arch) {
+  if (ProfileErr)
+    return std::move(ProfileErr);
+  std::vector<InputStamp> Stamps;
+  if (!getInputStamps(ObjectFilenames, ProfileFilename, Stamps))
+    return make_error<StringError>("could not get the status of the inputs",
+                                   inconvertibleErrorCode());
+  StringEntry ArchEntry = addString(Arch);
+  std::vector<StringEntry> InputNames;
+  for (const InputStamp &Stamp : Stamps)
+    InputNames.push_back(addString(Stamp.Name));
+  std::unique_ptr<MemoryBuffer> ProfileData = Profile.writeBuffer();
+
+  uint64_t Header[HF_NumFields];
+  uint64_t Offset = HF_NumFields * sizeof(uint64_t);
+  auto PlaceTable = [&](HeaderField NumEntries, uint64_t Count,
+                        uint64_t EntrySize) {
+    Header[NumEntries] = Count;
+    Header[NumEntries + 1] = Offset;
+    Offset += Count * EntrySize;
+  };
+  Header[HF_Magic] = SnapshotMagic;
+  Header[HF_Version] = SnapshotVersion;
+  Header[HF_ArchOffset] = ArchEntry.Offset;
+  Header[HF_ArchSize] = ArchEntry.Size;
+  PlaceTable(HF_NumInputs, Stamps.size(), InputEntrySize);
+  PlaceTable(HF_NumRecords, Records.size(), RecordEntrySize);
+  PlaceTable(HF_NumFilenames, Filenames.size(), FilenameEntrySize);
+  PlaceTable(HF_NumExpressions, Expressions.size(), ExpressionEntrySize);
+  PlaceTable(HF_NumRegions, Regions.size(), RegionEntrySize);
+  Header[HF_StringsOffset] = Offset;
+  Header[HF_StringsSize] = Strings.size();
+  Offset += Strings.size();
+  // The indexed profile reader expects its hash table to be aligned.
+  uint64_t Padding = alignTo(Offset, 8) - Offset;
+  Header[HF_ProfileOffset] = Offset + Padding;
+  Header[HF_ProfileSize] = ProfileData->getBufferSize();
+
+  // Write to a temporary file first, so that concurrent runs never see a
+  // partial snapshot.
+  int FD;
+  SmallString<128> TempPath;
+  if (std::error_code EC =
+          sys::fs::createUniqueFile(Path + "-%%%%%%", FD, TempPath))
+    return errorCodeToError(EC);
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    support::endian::Writer<support::little> LE(OS);
+    auto WriteCounter = [&](Counter C) {
+      LE.write<uint32_t>(C.getKind());
+      LE.write<uint32_t>(C.getCounterID());
+    };
+
+    for (uint64_t Field : Header)
+      LE.write<uint64_t>(Field);
+    for (unsigned I = 0, E = Stamps.size(); I < E; ++I) {
+      LE.write<uint64_t>(InputNames[I].Offset);
+      LE.write<uint64_t>(InputNames[I].Size);
+      LE.write<uint64_t>(Stamps[I].Size);
+      LE.write<uint64_t>(Stamps[I].ModTime);
+    }
+    for (const RecordEntry &Record : Records) {
+      LE.write<uint64_t>(Record.Name.Offset);
+      LE.write<uint64_t>(Record.Name.Size);
+      LE.write<uint64_t>(Record.Hash);
+      LE.write<uint64_t>(Record.FilenamesBegin);
+      LE.write<uint64_t>(Record.NumFilenames);
+      LE.write<uint64_t>(Record.ExpressionsBegin);
+      LE.write<uint64_t>(Record.NumExpressions);
+      LE.write<uint64_t>(Record.RegionsBegin);
+      LE.write<uint64_t>(Record.NumRegions);
+    }
+    for (const StringEntry &Filename : Filenames) {
+      LE.write<uint64_t>(Filename.Offset);
+      LE.write<uint64_t>(Filename.Size);
+    }
+    for (const CounterExpression &Expression : Expressions) {
+      LE.write<uint32_t>(Expression.Kind);
+      WriteCounter(Expression.LHS);
+      WriteCounter(Expression.RHS);
+    }
+    for (const CounterMappingRegion &Region : Regions) {
+      WriteCounter(Region.Count);
+      LE.write<uint32_t>(Region.FileID);
+      LE.write<uint32_t>(Region.ExpandedFileID);
+      LE.write<uint32_t>(Region.LineStart);
+      LE.write<uint32_t>(Region.ColumnStart);
+      LE.write<uint32_t>(Region.LineEnd);
+      LE.write<uint32_t>(Region.ColumnEnd);
+      LE.write<uint32_t>(Region.Kind);
+    }
+    OS << Strings;
+    for (; Padding; --Padding)
+      OS << '\0';
+    OS << ProfileData->getBuffer();
+
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+      return make_error<StringError>("could not write " + TempPath.str(),
+                                     inconvertibleErrorCode());
+    }
+  }
+
+  if (std::error_code EC = sys::fs::rename(TempPath, Path)) {
+    sys::fs::remove(TempPath);
+    return errorCodeToError(EC);
+  }
+  return Error::success();
+}
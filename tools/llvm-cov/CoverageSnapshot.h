@@ -0,0 +1,95 @@
+//===- CoverageSnapshot.h - Snapshots of loaded coverage mappings ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A coverage snapshot holds everything llvm-cov needs from a set of objects
+// and a profile: the decoded coverage mapping records of the objects and the
+// counts of just the functions they cover. It is a flat, memory-mapped file,
+// so later runs against the same inputs skip reading the objects, decoding
+// their coverage mapping sections and searching the full profile.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_COV_COVERAGESNAPSHOT_H
+#define LLVM_COV_COVERAGESNAPSHOT_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include "llvm/ProfileData/Coverage/CoverageMappingReader.h"
+#include "llvm/ProfileData/InstrProfWriter.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class IndexedInstrProfReader;
+
+/// \brief Load the coverage mapping from the snapshot in \p Path. Returns
+/// null if there is no usable snapshot there: if it is missing or damaged,
+/// or if it was made from other inputs than \p ObjectFilenames,
+/// \p ProfileFilename and \p Arch, or those have changed since.
+std::unique_ptr<coverage::CoverageMapping>
+loadCoverageSnapshot(StringRef Path, ArrayRef<StringRef> ObjectFilenames,
+                     StringRef ProfileFilename, StringRef Arch);
+
+/// \brief Collects the coverage mapping records read while the coverage of a
+/// set of objects is loaded, and writes them out as a snapshot.
+class CoverageSnapshotWriter {
+public:
+  /// \brief A range of the snapshot's string table.
+  struct StringEntry {
+    uint64_t Offset;
+    uint64_t Size;
+  };
+
+  /// \brief One mapping record, referring to ranges of the shared filename,
+  /// expression and region tables.
+  struct RecordEntry {
+    StringEntry Name;
+    uint64_t Hash;
+    uint64_t FilenamesBegin, NumFilenames;
+    uint64_t ExpressionsBegin, NumExpressions;
+    uint64_t RegionsBegin, NumRegions;
+  };
+
+private:
+  StringMap<StringEntry> StringEntries;
+  std::string Strings;
+  std::vector<RecordEntry> Records;
+  std::vector<StringEntry> Filenames;
+  std::vector<coverage::CounterExpression> Expressions;
+  std::vector<coverage::CounterMappingRegion> Regions;
+  /// The counts of the recorded functions.
+  InstrProfWriter Profile;
+  Error ProfileErr = Error::success();
+
+  StringEntry addString(StringRef S);
+
+public:
+  ~CoverageSnapshotWriter() { consumeError(std::move(ProfileErr)); }
+
+  /// \brief Wrap \p Reader so that every record read through it is added to
+  /// the snapshot, together with its function's counts in \p ProfileReader.
+  std::unique_ptr<coverage::CoverageMappingReader>
+  record(std::unique_ptr<coverage::CoverageMappingReader> Reader,
+         IndexedInstrProfReader &ProfileReader);
+
+  /// \brief Add a copy of \p Record and its counts to the snapshot.
+  void addRecord(const coverage::CoverageMappingRecord &Record,
+                 IndexedInstrProfReader &ProfileReader);
+
+  /// \brief Write everything recorded, along with the state of the inputs,
+  /// to \p Path.
+  Error write(StringRef Path, ArrayRef<StringRef> ObjectFilenames,
+              StringRef ProfileFilename, StringRef Arch);
+};
+
+} // end namespace llvm
+
+#endif // LLVM_COV_COVERAGESNAPSHOT_H
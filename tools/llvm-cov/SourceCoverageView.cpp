@@ -187,6 +187,12 @@ void SourceCoverageView::print(raw_ostream &OS, bool WholeFile,
   auto NextSegment = CoverageInfo.begin();
   auto EndSegment = CoverageInfo.end();
 
+  // Get the lines to show, if they are restricted.
+  auto NextShown = ShownLines.begin();
+  auto EndShown = ShownLines.end();
+  unsigned LastShownLine = 0;
+  ShownLineCoverage = LineCoverageInfo();
+
   unsigned FirstLine = NextSegment != EndSegment ? NextSegment->Line : 0;
   const coverage::CoverageSegment *WrappedSegment = nullptr;
   SmallVector<const coverage::CoverageSegment *, 8> LineSegments;
@@ -215,6 +221,29 @@ void SourceCoverageView::print(raw_ostream &OS, bool WholeFile,
       if (S->HasCount && S->IsRegionEntry)
         LineCount.addRegionStartCount(S->Count);
 
+    if (!ShownLines.empty()) {
+      unsigned LineNo = LI.line_number();
+      while (NextShown != EndShown && NextShown->second < LineNo)
+        ++NextShown;
+      if (NextShown == EndShown)
+        break;
+      if (NextShown->first > LineNo) {
+        // Skip the line's sub-views along with it.
+        while (NextESV != EndESV && NextESV->getLine() == LineNo)
+          ++NextESV;
+        while (NextISV != EndISV && NextISV->Line == LineNo)
+          ++NextISV;
+        continue;
+      }
+
+      if (LineCount.isMapped())
+        ShownLineCoverage += LineCoverageInfo(LineCount.ExecutionCount > 0, 1);
+      // Mark the gap before each run of lines after the first.
+      if (LastShownLine && LastShownLine + 1 != LineNo)
+        renderViewDivider(OS, ViewDepth + 1);
+      LastShownLine = LineNo;
+    }
+
     renderLinePrefix(OS, ViewDepth);
     if (getOptions().ShowLineNumbers)
       renderLineNumberColumn(OS, LI.line_number());
@@ -14,6 +14,7 @@
 #ifndef LLVM_COV_SOURCECOVERAGEVIEW_H
 #define LLVM_COV_SOURCECOVERAGEVIEW_H
 
+#include "CoverageSummaryInfo.h"
 #include "CoverageViewOptions.h"
 #include "llvm/ProfileData/Coverage/CoverageMapping.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -23,6 +24,9 @@ namespace llvm {
 
 class SourceCoverageView;
 
+/// \brief Sorted, disjoint ranges [First, Last] of line numbers.
+using LineRangeList = std::vector<std::pair<unsigned, unsigned>>;
+
 /// \brief A view that represents a macro or include expansion.
 struct ExpansionView {
   coverage::CounterMappingRegion Region;
@@ -136,6 +140,10 @@ public:
   virtual Error createIndexFile(ArrayRef<std::string> SourceFiles,
                                 const coverage::CoverageMapping &Coverage) = 0;
 
+  /// \brief Check if the output directory already has a view file for
+  /// \p Path, e.g from an earlier run.
+  virtual bool hasViewFile(StringRef Path, bool InToplevel) const = 0;
+
   /// @}
 };
 
@@ -164,6 +172,12 @@ class SourceCoverageView {
   /// on display.
   std::vector<InstantiationView> InstantiationSubViews;
 
+  /// The lines to show, or empty to show all of them.
+  LineRangeList ShownLines;
+
+  /// Coverage of the mapped lines within ShownLines, as of the last print.
+  LineCoverageInfo ShownLineCoverage;
+
   /// Get the first uncovered line number for the source file.
   unsigned getFirstUncoveredLineNo();
 
@@ -278,6 +292,15 @@ public:
   void addInstantiation(StringRef FunctionName, unsigned Line,
                         std::unique_ptr<SourceCoverageView> View);
 
+  /// \brief Only show the lines in \p Lines, along with their sub-views.
+  void restrictToLines(LineRangeList Lines) { ShownLines = std::move(Lines); }
+
+  /// \brief Get the coverage of the lines shown by the last print, if they
+  /// were restricted by restrictToLines().
+  const LineCoverageInfo &getShownLineCoverage() const {
+    return ShownLineCoverage;
+  }
+
   /// \brief Print the code coverage information for a specific portion of a
   /// source file to the output stream.
   void print(raw_ostream &OS, bool WholeFile, bool ShowSourceName,
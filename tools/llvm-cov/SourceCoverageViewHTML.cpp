@@ -284,6 +284,11 @@ void CoveragePrinterHTML::closeViewFile(OwnedStream OS) {
   emitEpilog(*OS.get());
 }
 
+bool CoveragePrinterHTML::hasViewFile(StringRef Path, bool InToplevel) const {
+  return sys::fs::exists(
+      getOutputPath(Path, "html", InToplevel, /*Relative=*/false));
+}
+
 /// Emit column labels for the table in the index.
 static void emitColumnLabelsForIndex(raw_ostream &OS) {
   SmallVector<std::string, 4> Columns;
@@ -391,7 +396,8 @@ Error CoveragePrinterHTML::createIndexFile(
   emitColumnLabelsForIndex(OSRef);
   FileCoverageSummary Totals("TOTALS");
   auto FileReports =
-      CoverageReport::prepareFileReports(Coverage, Totals, SourceFiles);
+      CoverageReport::prepareFileReports(Coverage, Totals, SourceFiles,
+                                         Opts.NumThreads);
   for (unsigned I = 0, E = FileReports.size(); I < E; ++I)
     emitFileSummary(OSRef, SourceFiles[I], FileReports[I]);
   emitFileSummary(OSRef, "Totals", Totals, /*IsTotals=*/true);
@@ -31,6 +31,8 @@ public:
   Error createIndexFile(ArrayRef<std::string> SourceFiles,
                         const coverage::CoverageMapping &Coverage) override;
 
+  bool hasViewFile(StringRef Path, bool InToplevel) const override;
+
   CoveragePrinterHTML(const CoverageViewOptions &Opts)
       : CoveragePrinter(Opts) {}
 
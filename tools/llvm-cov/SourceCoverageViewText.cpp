@@ -16,6 +16,7 @@
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
 
 using namespace llvm;
 
@@ -28,6 +29,11 @@ void CoveragePrinterText::closeViewFile(OwnedStream OS) {
   OS->operator<<('\n');
 }
 
+bool CoveragePrinterText::hasViewFile(StringRef Path, bool InToplevel) const {
+  return sys::fs::exists(
+      getOutputPath(Path, "txt", InToplevel, /*Relative=*/false));
+}
+
 Error CoveragePrinterText::createIndexFile(
     ArrayRef<std::string> SourceFiles,
     const coverage::CoverageMapping &Coverage) {
@@ -29,6 +29,8 @@ public:
   Error createIndexFile(ArrayRef<std::string> SourceFiles,
                         const coverage::CoverageMapping &Coverage) override;
 
+  bool hasViewFile(StringRef Path, bool InToplevel) const override;
+
   CoveragePrinterText(const CoverageViewOptions &Opts)
       : CoveragePrinter(Opts) {}
 };
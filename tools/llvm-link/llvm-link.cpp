@@ -13,8 +13,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/AutoUpgrade.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LLVMContext.h"
@@ -27,16 +30,19 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/SystemUtils.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Transforms/IPO/FunctionImport.h"
 #include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/Utils/FunctionImportUtils.h"
 
+#include <atomic>
 #include <memory>
 #include <utility>
 using namespace llvm;
@@ -110,6 +116,22 @@ static cl::opt<bool> PreserveAssemblyUseListOrder(
     cl::desc("Preserve use-list order when writing LLVM assembly."),
     cl::init(false), cl::Hidden);
 
+static cl::opt<unsigned>
+    Jobs("j", cl::init(1), cl::value_desc("N"),
+         cl::desc("Number of threads reading inputs into memory ahead of "
+                  "the linker, which still parses and links them one at a "
+                  "time, or linking them with -tree-merge"));
+
+static cl::opt<bool>
+    TreeMerge("tree-merge",
+              cl::desc("Link the inputs pairwise in a balanced tree on -j "
+                       "threads instead of one after another"));
+
+static cl::opt<bool> MergeStringTables(
+    "merge-string-tables",
+    cl::desc("Merge the lookup_table_compressed word tables emitted by the "
+             "hello3 pass into one table without duplicate words"));
+
 static ExitOnError ExitOnErr;
 
 // Read the specified bitcode file in and return it. This routine searches the
@@ -140,8 +162,96 @@ static std::unique_ptr<Module> loadFile(const char *argv0,
   return Result;
 }
 
+/// Like loadFile, for an input whose contents have already been read into
+/// \p Buffer.
+static std::unique_ptr<Module> loadBuffer(const char *argv0,
+                                          const std::string &FN,
+                                          std::unique_ptr<MemoryBuffer> Buffer,
+                                          LLVMContext &Context) {
+  if (Verbose) errs() << "Loading '" << FN << "'\n";
+  std::unique_ptr<Module> Result;
+  const unsigned char *Start =
+      reinterpret_cast<const unsigned char *>(Buffer->getBufferStart());
+  const unsigned char *End =
+      reinterpret_cast<const unsigned char *>(Buffer->getBufferEnd());
+  if (DisableLazyLoad || !isBitcode(Start, End)) {
+    SMDiagnostic Err;
+    Result = parseIR(Buffer->getMemBufferRef(), Err, Context);
+    if (!Result) {
+      Err.print(argv0, errs());
+      return nullptr;
+    }
+  } else {
+    Expected<std::unique_ptr<Module>> ModuleOrErr =
+        getOwningLazyBitcodeModule(std::move(Buffer), Context);
+    if (!ModuleOrErr) {
+      logAllUnhandledErrors(ModuleOrErr.takeError(), errs(),
+                            Twine(argv0) + ": " + FN + ": ");
+      return nullptr;
+    }
+    Result = std::move(*ModuleOrErr);
+  }
+
+  ExitOnErr(Result->materializeMetadata());
+  UpgradeDebugInfo(*Result);
+  return Result;
+}
+
 namespace {
 
+/// Reads inputs on a thread pool ahead of the linker, keeping at most Window
+/// of them in flight. Only the file contents are read on the workers: a module
+/// cannot move between LLVMContexts, so parsing into the shared context stays
+/// on the linker thread.
+class InputPrefetcher {
+public:
+  struct Input {
+    std::unique_ptr<MemoryBuffer> Buffer;
+    std::error_code EC;
+  };
+
+  InputPrefetcher(const cl::list<std::string> &Files, unsigned Window)
+      : Files(Files), Window(Window), Inputs(Files.size()),
+        Ready(Files.size()), Pool(Window) {
+    for (unsigned I = 0, E = std::min<size_t>(Window, Files.size()); I != E;
+         ++I)
+      schedule(I);
+  }
+
+  /// Wait for input \p I, start on the next one outside the window, and hand
+  /// \p I over to the caller. Inputs must be taken in order.
+  std::unique_ptr<Input> take(unsigned I) {
+    Ready[I].wait();
+    if (I + Window < Files.size())
+      schedule(I + Window);
+    return std::move(Inputs[I]);
+  }
+
+private:
+  const cl::list<std::string> &Files;
+  unsigned Window;
+  std::vector<std::unique_ptr<Input>> Inputs;
+  std::vector<std::shared_future<ThreadPool::VoidTy>> Ready;
+  // Declared last so pending work finishes before Inputs is destroyed.
+  ThreadPool Pool;
+
+  void schedule(unsigned I) {
+    Inputs[I] = llvm::make_unique<Input>();
+    Input *In = Inputs[I].get();
+    const std::string &File = Files[I];
+    Ready[I] = Pool.async([In, &File] { prefetch(File, *In); });
+  }
+
+  static void prefetch(const std::string &File, Input &In) {
+    auto BufferOrErr = MemoryBuffer::getFileOrSTDIN(File);
+    if (!BufferOrErr) {
+      In.EC = BufferOrErr.getError();
+      return;
+    }
+    In.Buffer = std::move(*BufferOrErr);
+  }
+};
+
 /// Helper to load on demand a Module from file and cache it for subsequent
 /// queries during function importing.
 class ModuleLazyLoaderCache {
@@ -182,6 +292,170 @@ Module &ModuleLazyLoaderCache::operator()(const char *argv0,
 }
 } // anonymous namespace
 
+static const char *const TableName = "lookup_table_compressed";
+
+namespace {
+
+/// Merges the lookup_table_compressed word tables written by the hello3 pass.
+/// Each input's table is reduced to a declaration before it is linked, and the
+/// .wordIndexGlobal arrays that index into it are renumbered against a single
+/// deduplicated word list, which is emitted into the composite at the end.
+class StringTableMerger {
+  /// Index of each word in the merged table.
+  StringMap<unsigned> WordIndex;
+
+  /// The merged table in index order; keys owned by WordIndex.
+  std::vector<StringRef> Words;
+
+  unsigned NumTables = 0;
+  unsigned NumInputWords = 0;
+
+public:
+  /// Fold the table defined in \p M, if any, into the merged table. Returns
+  /// false if \p M holds a table or index array this tool does not understand.
+  bool addModule(Module &M);
+
+  /// Define the merged table in \p Composite, replacing the declaration left
+  /// behind by addModule.
+  void emit(Module &Composite);
+};
+
+} // anonymous namespace
+
+bool StringTableMerger::addModule(Module &M) {
+  GlobalVariable *Table = M.getGlobalVariable(TableName);
+  if (!Table || !Table->hasInitializer())
+    return true;
+
+  auto *TableTy = dyn_cast<ArrayType>(Table->getValueType());
+  if (!TableTy) {
+    errs() << M.getModuleIdentifier() << ": error: " << TableName
+           << " is not an array\n";
+    return false;
+  }
+
+  // Map each word of this module's table to its index in the merged table.
+  SmallVector<unsigned, 64> Remap;
+  SmallVector<GlobalVariable *, 64> WordGlobals;
+  Constant *Init = Table->getInitializer();
+  for (unsigned I = 0, E = TableTy->getNumElements(); I != E; ++I) {
+    auto *WordGV = dyn_cast<GlobalVariable>(
+        Init->getAggregateElement(I)->stripPointerCasts());
+    Constant *WordInit = WordGV && WordGV->hasInitializer()
+                             ? WordGV->getInitializer()
+                             : nullptr;
+    // An empty word is emitted as a zeroinitializer [1 x i8].
+    StringRef Word;
+    bool IsString = false;
+    if (auto *Data = dyn_cast_or_null<ConstantDataArray>(WordInit)) {
+      IsString = Data->isCString();
+      if (IsString)
+        Word = Data->getAsCString();
+    } else if (WordInit && isa<ConstantAggregateZero>(WordInit)) {
+      Type *WordTy = WordInit->getType();
+      IsString = WordTy->isArrayTy() &&
+                 WordTy->getArrayElementType()->isIntegerTy(8);
+    }
+    if (!IsString) {
+      errs() << M.getModuleIdentifier() << ": error: entry " << I << " of "
+             << TableName << " is not a string constant\n";
+      return false;
+    }
+    auto Inserted = WordIndex.insert({Word, Words.size()});
+    if (Inserted.second)
+      Words.push_back(Inserted.first->getKey());
+    Remap.push_back(Inserted.first->second);
+    WordGlobals.push_back(WordGV);
+  }
+
+  // Renumber every word index stream against the merged table. An array of
+  // nothing but word 0 is emitted as a zeroinitializer, and still has to be
+  // renumbered, so the elements are read through getAggregateElement.
+  for (GlobalVariable &GV : M.globals()) {
+    if (!GV.getName().startswith(".wordIndexGlobal") || !GV.hasInitializer())
+      continue;
+    Constant *Indices = GV.getInitializer();
+    auto *IndicesTy = dyn_cast<ArrayType>(Indices->getType());
+    if (!IndicesTy || !IndicesTy->getElementType()->isIntegerTy(32)) {
+      errs() << M.getModuleIdentifier() << ": error: " << GV.getName()
+             << " is not an array of i32\n";
+      return false;
+    }
+    SmallVector<uint32_t, 16> NewIndices;
+    for (unsigned I = 0, E = IndicesTy->getNumElements(); I != E; ++I) {
+      auto *Element =
+          dyn_cast_or_null<ConstantInt>(Indices->getAggregateElement(I));
+      if (!Element) {
+        errs() << M.getModuleIdentifier() << ": error: entry " << I << " of "
+               << GV.getName() << " is not a constant integer\n";
+        return false;
+      }
+      uint64_t OldIndex = Element->getZExtValue();
+      if (OldIndex >= Remap.size()) {
+        errs() << M.getModuleIdentifier() << ": error: " << GV.getName()
+               << " indexes past the end of " << TableName << "\n";
+        return false;
+      }
+      NewIndices.push_back(Remap[OldIndex]);
+    }
+    GV.setInitializer(ConstantDataArray::get(M.getContext(), NewIndices));
+  }
+
+  // Leave a declaration behind so uses in this module resolve to the merged
+  // definition, and drop the word strings nothing else refers to.
+  Table->setInitializer(nullptr);
+  Table->setLinkage(GlobalValue::ExternalLinkage);
+  for (GlobalVariable *WordGV : WordGlobals) {
+    WordGV->removeDeadConstantUsers();
+    if (WordGV->use_empty() && WordGV->hasLocalLinkage())
+      WordGV->eraseFromParent();
+  }
+
+  ++NumTables;
+  NumInputWords += Remap.size();
+  return true;
+}
+
+void StringTableMerger::emit(Module &Composite) {
+  if (!NumTables)
+    return;
+
+  LLVMContext &Ctx = Composite.getContext();
+  Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+  Constant *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+  Constant *IndexList[] = {Zero, Zero};
+
+  std::vector<Constant *> Entries;
+  Entries.reserve(Words.size());
+  for (StringRef Word : Words) {
+    Constant *Str = ConstantDataArray::getString(Ctx, Word, /*AddNull=*/true);
+    auto *StrGV = new GlobalVariable(Composite, Str->getType(),
+                                     /*isConstant=*/true,
+                                     GlobalValue::PrivateLinkage, Str,
+                                     ".compStr");
+    StrGV->setAlignment(1);
+    Entries.push_back(ConstantExpr::getInBoundsGetElementPtr(
+        Str->getType(), StrGV, IndexList));
+  }
+
+  ArrayType *TableTy = ArrayType::get(Int8PtrTy, Entries.size());
+  auto *Merged = new GlobalVariable(Composite, TableTy, /*isConstant=*/true,
+                                    GlobalValue::ExternalLinkage,
+                                    ConstantArray::get(TableTy, Entries));
+  Merged->setAlignment(4);
+  if (GlobalVariable *Decl = Composite.getGlobalVariable(TableName)) {
+    Decl->replaceAllUsesWith(ConstantExpr::getBitCast(Merged, Decl->getType()));
+    Merged->takeName(Decl);
+    Decl->eraseFromParent();
+  } else {
+    Merged->setName(TableName);
+  }
+
+  if (Verbose)
+    errs() << "Merged " << NumTables << " string tables: " << NumInputWords
+           << " words into " << Words.size() << "\n";
+}
+
 static void diagnosticHandler(const DiagnosticInfo &DI, void *C) {
   unsigned Severity = DI.getSeverity();
   switch (Severity) {
@@ -203,6 +477,100 @@ static void diagnosticHandler(const DiagnosticInfo &DI, void *C) {
   errs() << '\n';
 }
 
+static void configureContext(LLVMContext &Context) {
+  Context.setDiagnosticHandler(diagnosticHandler, nullptr, true);
+  if (!DisableDITypeMap)
+    Context.enableDebugTypeODRUniquing();
+}
+
+namespace {
+/// A node of the -tree-merge reduction: an input file, or the bitcode of the
+/// module linked from a run of inputs in an earlier round.
+struct LinkPiece {
+  std::string Name;
+  std::unique_ptr<MemoryBuffer> Bitcode;
+};
+} // anonymous namespace
+
+static std::unique_ptr<Module> loadPiece(const char *argv0, LinkPiece &Piece,
+                                         LLVMContext &Context) {
+  if (Piece.Bitcode)
+    return loadBuffer(argv0, Piece.Name, std::move(Piece.Bitcode), Context);
+
+  std::unique_ptr<Module> M = loadFile(argv0, Piece.Name, Context);
+  if (!M.get()) {
+    errs() << argv0 << ": error loading file '" << Piece.Name << "'\n";
+    return nullptr;
+  }
+  // Inputs are verified as in linkFiles; intermediate results are not.
+  if (DisableDITypeMap && verifyModule(*M, &errs())) {
+    errs() << argv0 << ": " << Piece.Name
+           << ": error: input module is broken!\n";
+    return nullptr;
+  }
+  return M;
+}
+
+/// Links \p Right after \p Left in a private context and replaces \p Left
+/// with the bitcode of the result.
+static bool linkPiecePair(const char *argv0, LinkPiece &Left,
+                          LinkPiece &Right) {
+  LLVMContext Context;
+  configureContext(Context);
+  auto Composite = make_unique<Module>("llvm-link", Context);
+  Linker L(*Composite);
+
+  for (LinkPiece *Piece : {&Left, &Right}) {
+    std::unique_ptr<Module> M = loadPiece(argv0, *Piece, Context);
+    if (!M)
+      return false;
+    if (Verbose)
+      errs() << "Linking in '" << Piece->Name << "'\n";
+    if (L.linkInModule(std::move(M)))
+      return false;
+  }
+
+  SmallVector<char, 0> Buffer;
+  raw_svector_ostream OS(Buffer);
+  WriteBitcodeToFile(Composite.get(), OS, PreserveBitcodeUseListOrder);
+  Left.Bitcode = MemoryBuffer::getMemBufferCopy(
+      StringRef(Buffer.data(), Buffer.size()), Left.Name);
+  return true;
+}
+
+/// Links \p Files in a balanced tree: each round links neighbouring pieces
+/// pairwise on -j threads, keeping their order, until one module is left. It
+/// is returned loaded into \p Context.
+static std::unique_ptr<Module>
+treeLinkFiles(const char *argv0, LLVMContext &Context,
+              const cl::list<std::string> &Files) {
+  std::vector<LinkPiece> Pieces;
+  for (const auto &File : Files)
+    Pieces.push_back({File, nullptr});
+
+  ThreadPool Pool(Jobs);
+  while (Pieces.size() > 1) {
+    std::atomic<bool> Failed(false);
+    for (size_t I = 0; I + 1 < Pieces.size(); I += 2)
+      Pool.async([&, I] {
+        if (!linkPiecePair(argv0, Pieces[I], Pieces[I + 1]))
+          Failed = true;
+      });
+    Pool.wait();
+    if (Failed)
+      return nullptr;
+
+    // The left piece of each pair now holds the pair; an unpaired last piece
+    // moves up unchanged.
+    std::vector<LinkPiece> Next;
+    for (size_t I = 0; I < Pieces.size(); I += 2)
+      Next.push_back(std::move(Pieces[I]));
+    Pieces = std::move(Next);
+  }
+
+  return loadPiece(argv0, Pieces.front(), Context);
+}
+
 /// Import any functions requested via the -import option.
 static bool importFunctions(const char *argv0, Module &DestModule) {
   if (SummaryIndex.empty())
@@ -268,15 +636,55 @@ static bool importFunctions(const char *argv0, Module &DestModule) {
   return true;
 }
 
+/// The -summary-index used to promote locals in linkFiles. It is read once
+/// and shared by every input; the entries markLocalsExported has updated stay
+/// updated for later inputs.
+static ModuleSummaryIndex &getPromotionSummaryIndex() {
+  static std::unique_ptr<ModuleSummaryIndex> Index =
+      ExitOnErr(llvm::getModuleSummaryIndexForFile(SummaryIndex));
+  return *Index;
+}
+
+/// Give the summaries of every local value in \p M external linkage, looking
+/// them up by GUID rather than walking the whole index.
+static void markLocalsExported(Module &M, ModuleSummaryIndex &Index) {
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage() || !GV.hasName())
+      continue;
+    auto I = Index.findGlobalValueSummaryList(GV.getGUID());
+    if (I == Index.end())
+      continue;
+    for (auto &S : I->second)
+      if (GlobalValue::isLocalLinkage(S->linkage()))
+        S->setLinkage(GlobalValue::ExternalLinkage);
+  }
+}
+
 static bool linkFiles(const char *argv0, LLVMContext &Context, Linker &L,
                       const cl::list<std::string> &Files,
-                      unsigned Flags) {
+                      unsigned Flags, StringTableMerger &StringTables) {
   // Filter out flags that don't apply to the first file we load.
   unsigned ApplicableFlags = Flags & Linker::Flags::OverrideFromSrc;
   // Similar to some flags, internalization doesn't apply to the first file.
   bool InternalizeLinkedSymbols = false;
+  std::unique_ptr<InputPrefetcher> Prefetcher;
+  if (Jobs > 1)
+    Prefetcher = llvm::make_unique<InputPrefetcher>(Files, Jobs);
+  unsigned FileIdx = 0;
   for (const auto &File : Files) {
-    std::unique_ptr<Module> M = loadFile(argv0, File, Context);
+    std::unique_ptr<Module> M;
+    if (Prefetcher) {
+      std::unique_ptr<InputPrefetcher::Input> In = Prefetcher->take(FileIdx);
+      if (In->EC) {
+        errs() << argv0 << ": " << File << ": " << In->EC.message() << '\n';
+        errs() << argv0 << ": error loading file '" << File << "'\n";
+        return false;
+      }
+      M = loadBuffer(argv0, File, std::move(In->Buffer), Context);
+    } else {
+      M = loadFile(argv0, File, Context);
+    }
+    ++FileIdx;
     if (!M.get()) {
       errs() << argv0 << ": error loading file '" << File << "'\n";
       return false;
@@ -290,24 +698,21 @@ static bool linkFiles(const char *argv0, LLVMContext &Context, Linker &L,
       return false;
     }
 
-    // If a module summary index is supplied, load it so linkInModule can treat
+    if (MergeStringTables && !StringTables.addModule(*M))
+      return false;
+
+    // If a module summary index is supplied, use it so linkInModule can treat
     // local functions/variables as exported and promote if necessary.
     if (!SummaryIndex.empty()) {
-      std::unique_ptr<ModuleSummaryIndex> Index =
-          ExitOnErr(llvm::getModuleSummaryIndexForFile(SummaryIndex));
+      ModuleSummaryIndex &Index = getPromotionSummaryIndex();
 
       // Conservatively mark all internal values as promoted, since this tool
       // does not do the ThinLink that would normally determine what values to
-      // promote.
-      for (auto &I : *Index) {
-        for (auto &S : I.second) {
-          if (GlobalValue::isLocalLinkage(S->linkage()))
-            S->setLinkage(GlobalValue::ExternalLinkage);
-        }
-      }
+      // promote. Only the entries for this module's locals are looked at.
+      markLocalsExported(*M, Index);
 
       // Promotion
-      if (renameModuleForThinLTO(*M, *Index))
+      if (renameModuleForThinLTO(*M, Index))
         return true;
     }
 
@@ -347,13 +752,20 @@ int main(int argc, char **argv) {
   ExitOnErr.setBanner(std::string(argv[0]) + ": ");
 
   LLVMContext Context;
-  Context.setDiagnosticHandler(diagnosticHandler, nullptr, true);
 
   llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
   cl::ParseCommandLineOptions(argc, argv, "llvm linker\n");
 
-  if (!DisableDITypeMap)
-    Context.enableDebugTypeODRUniquing();
+  configureContext(Context);
+
+  // These options treat the first input differently from the rest, or keep
+  // state across every input, neither of which the tree has.
+  if (TreeMerge && (Internalize || OnlyNeeded || MergeStringTables ||
+                    !SummaryIndex.empty())) {
+    errs() << argv[0] << ": -tree-merge cannot be used with -internalize, "
+           << "-only-needed, -merge-string-tables or -summary-index\n";
+    return 1;
+  }
 
   auto Composite = make_unique<Module>("llvm-link", Context);
   Linker L(*Composite);
@@ -362,15 +774,26 @@ int main(int argc, char **argv) {
   if (OnlyNeeded)
     Flags |= Linker::Flags::LinkOnlyNeeded;
 
+  StringTableMerger StringTables;
+
   // First add all the regular input files
-  if (!linkFiles(argv[0], Context, L, InputFilenames, Flags))
+  if (TreeMerge) {
+    std::unique_ptr<Module> Merged =
+        treeLinkFiles(argv[0], Context, InputFilenames);
+    if (!Merged || L.linkInModule(std::move(Merged)))
+      return 1;
+  } else if (!linkFiles(argv[0], Context, L, InputFilenames, Flags,
+                        StringTables))
     return 1;
 
   // Next the -override ones.
   if (!linkFiles(argv[0], Context, L, OverridingInputs,
-                 Flags | Linker::Flags::OverrideFromSrc))
+                 Flags | Linker::Flags::OverrideFromSrc, StringTables))
     return 1;
 
+  // Then the merged hello3 string table, now that every input has been seen.
+  StringTables.emit(*Composite);
+
   // Import any functions requested via -import
   if (!importFunctions(argv[0], *Composite))
     return 1;
@@ -13,28 +13,43 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/CodeGen/CommandFlags.h"
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/LTO/legacy/LTOCodeGenerator.h"
 #include "llvm/LTO/legacy/LTOModule.h"
 #include "llvm/LTO/legacy/ThinLTOCodeGenerator.h"
+#include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Object/ModuleSummaryIndexObjectFile.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/ObjCARC.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <list>
+#include <numeric>
+#include <queue>
 
 using namespace llvm;
 
@@ -171,6 +186,15 @@ static cl::opt<bool> SetMergedModule(
 static cl::opt<unsigned> Parallelism("j", cl::Prefix, cl::init(1),
                                      cl::desc("Number of backend threads"));
 
+static cl::opt<bool> PartitionReport(
+    "partition-report", cl::init(false),
+    cl::desc("Print the size and codegen time of each -j partition"));
+
+static cl::opt<bool> BalancePartitions(
+    "balance-partitions", cl::init(false),
+    cl::desc("Split -j partitions by estimated codegen cost instead of by "
+             "symbol name hash"));
+
 static cl::opt<bool> RestoreGlobalsLinkage(
     "restore-linkage", cl::init(false),
     cl::desc("Restore original linkage of globals prior to CodeGen"));
@@ -745,6 +769,242 @@ private:
 
 } // namespace thinlto
 
+namespace {
+/// Size and backend time of one -j partition.
+struct PartitionInfo {
+  unsigned Functions = 0;
+  uint64_t Instructions = 0;
+  double CodeGenSeconds = 0;
+};
+}
+
+/// Globals that have to land in the same partition are keyed by their comdat,
+/// or by the object an alias resolves to.
+static const void *getPartitionKey(const GlobalValue &GV) {
+  const GlobalValue *Base = GV.getBaseObject();
+  if (!Base)
+    Base = &GV;
+  if (const Comdat *C = Base->getComdat())
+    return C;
+  return Base;
+}
+
+static StringRef getPartitionKeyName(const GlobalValue &GV) {
+  const GlobalValue *Base = GV.getBaseObject();
+  if (!Base)
+    Base = &GV;
+  if (const Comdat *C = Base->getComdat())
+    return C->getName();
+  return Base->getName();
+}
+
+/// Estimated codegen cost of a global: its instruction count for functions,
+/// and a token amount for anything else that has to be emitted.
+static uint64_t getCodeGenCost(const GlobalValue &GV) {
+  const auto *F = dyn_cast<Function>(&GV);
+  if (!F)
+    return 1;
+  uint64_t Cost = 0;
+  for (const BasicBlock &BB : *F)
+    Cost += BB.size();
+  return Cost;
+}
+
+/// Assign every partition key in \p M to one of \p N partitions. By default
+/// keys are spread by a hash of their name, the same way splitCodeGen does;
+/// with -balance-partitions the most expensive keys are placed first, each on
+/// the least loaded partition so far.
+static DenseMap<const void *, unsigned> assignPartitions(Module &M,
+                                                         unsigned N) {
+  DenseMap<const void *, unsigned> KeyIndex;
+  std::vector<std::pair<const void *, uint64_t>> Keys;
+  std::vector<StringRef> KeyNames;
+  auto AddGlobal = [&](GlobalValue &GV) {
+    if (GV.isDeclaration())
+      return;
+    auto Insert = KeyIndex.insert({getPartitionKey(GV), Keys.size()});
+    if (Insert.second) {
+      Keys.push_back({Insert.first->first, 0});
+      KeyNames.push_back(getPartitionKeyName(GV));
+    }
+    Keys[Insert.first->second].second += getCodeGenCost(GV);
+  };
+  for (Function &F : M)
+    AddGlobal(F);
+  for (GlobalVariable &GV : M.globals())
+    AddGlobal(GV);
+  for (GlobalAlias &GA : M.aliases())
+    AddGlobal(GA);
+
+  DenseMap<const void *, unsigned> Assignment;
+  if (!BalancePartitions) {
+    for (unsigned I = 0, E = Keys.size(); I != E; ++I) {
+      MD5 Hash;
+      MD5::MD5Result Result;
+      Hash.update(KeyNames[I]);
+      Hash.final(Result);
+      Assignment[Keys[I].first] = (Result[0] | (Result[1] << 8)) % N;
+    }
+    return Assignment;
+  }
+
+  std::vector<unsigned> Order(Keys.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+    return Keys[A].second > Keys[B].second;
+  });
+  typedef std::pair<uint64_t, unsigned> Load;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load>> Loads;
+  for (unsigned I = 0; I != N; ++I)
+    Loads.push({0, I});
+  for (unsigned KeyIdx : Order) {
+    Load Least = Loads.top();
+    Loads.pop();
+    Assignment[Keys[KeyIdx].first] = Least.second;
+    Loads.push({Least.first + Keys[KeyIdx].second, Least.second});
+  }
+  return Assignment;
+}
+
+/// Give every local symbol hidden external linkage so that partitions can
+/// refer to definitions that ended up in another partition.
+static void externalizeLocals(Module &M) {
+  auto Externalize = [](GlobalValue &GV) {
+    if (GV.hasLocalLinkage()) {
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::HiddenVisibility);
+    }
+    if (!GV.hasName())
+      GV.setName("__llvmsplit_unnamed");
+  };
+  for (Function &F : M)
+    Externalize(F);
+  for (GlobalVariable &GV : M.globals())
+    Externalize(GV);
+  for (GlobalAlias &GA : M.aliases())
+    Externalize(GA);
+}
+
+static CodeGenOpt::Level getCodeGenOptLevel() {
+  switch (OptLevel) {
+  case '0':
+    return CodeGenOpt::None;
+  case '1':
+    return CodeGenOpt::Less;
+  case '3':
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+/// Split the optimized module \p M into OSs.size() partitions and generate
+/// code for each on its own thread, like LTOCodeGenerator::compileOptimized
+/// does, but recording the size and codegen time of every partition.
+static std::vector<PartitionInfo>
+splitCodeGenWithStats(std::unique_ptr<Module> M,
+                      ArrayRef<raw_pwrite_stream *> OSs,
+                      const TargetOptions &Options, StringRef Attrs) {
+  std::string TripleStr = M->getTargetTriple();
+  if (TripleStr.empty())
+    TripleStr = sys::getDefaultTargetTriple();
+  Triple TheTriple(TripleStr);
+  std::string ErrMsg;
+  const Target *TheTarget = TargetRegistry::lookupTarget(TripleStr, ErrMsg);
+  if (!TheTarget)
+    error("cannot find target for '" + TripleStr + "': " + ErrMsg);
+
+  // Pick the CPU, features and code model LTOCodeGenerator::determineTarget
+  // would, so the partitions get the code compileOptimized would generate.
+  SubtargetFeatures Features(Attrs);
+  Features.getDefaultSubtargetFeatures(TheTriple);
+  std::string FeatureStr = Features.getString();
+  std::string CPU = MCPU;
+  if (CPU.empty() && TheTriple.isOSDarwin()) {
+    if (TheTriple.getArch() == Triple::x86_64)
+      CPU = "core2";
+    else if (TheTriple.getArch() == Triple::x86)
+      CPU = "yonah";
+    else if (TheTriple.getArch() == Triple::aarch64)
+      CPU = "cyclone";
+  }
+  auto CreateTM = [&]() {
+    return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+        TripleStr, CPU, FeatureStr, Options, getRelocModel(),
+        CodeModel::Default, getCodeGenOptLevel()));
+  };
+  TargetMachine::CodeGenFileType FT = FileType.getNumOccurrences()
+                                          ? FileType
+                                          : TargetMachine::CGFT_ObjectFile;
+
+  // Match what compileOptimized runs ahead of splitting.
+  legacy::PassManager PreCodeGenPasses;
+  PreCodeGenPasses.add(createObjCARCContractPass());
+  PreCodeGenPasses.run(*M);
+
+  unsigned N = OSs.size();
+  if (N > 1)
+    externalizeLocals(*M);
+  DenseMap<const void *, unsigned> Assignment = assignPartitions(*M, N);
+
+  std::vector<PartitionInfo> Infos(N);
+  std::vector<SmallString<0>> Bitcode(N);
+  for (unsigned I = 0; I != N; ++I) {
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Part =
+        CloneModule(M.get(), VMap, [&](const GlobalValue *GV) {
+          return Assignment.lookup(getPartitionKey(*GV)) == I;
+        });
+    for (const Function &F : *Part) {
+      if (F.isDeclaration())
+        continue;
+      ++Infos[I].Functions;
+      Infos[I].Instructions += getCodeGenCost(F);
+    }
+    // Each partition is code generated in a context of its own.
+    raw_svector_ostream BCOS(Bitcode[I]);
+    WriteBitcodeToFile(Part.get(), BCOS);
+  }
+  M.reset();
+
+  ThreadPool CodeGenThreadPool(N);
+  for (unsigned I = 0; I != N; ++I) {
+    CodeGenThreadPool.async([&, I]() {
+      TimeRecord Start = TimeRecord::getCurrentTime(true);
+      LLVMContext Ctx;
+      MemoryBufferRef BC(StringRef(Bitcode[I].data(), Bitcode[I].size()),
+                         "<split-module>");
+      Expected<std::unique_ptr<Module>> PartOrErr = parseBitcodeFile(BC, Ctx);
+      if (!PartOrErr)
+        report_fatal_error("Failed to read partition bitcode");
+      std::unique_ptr<TargetMachine> TM = CreateTM();
+      legacy::PassManager CodeGenPasses;
+      if (TM->addPassesToEmitFile(CodeGenPasses, *OSs[I], FT))
+        report_fatal_error("Failed to setup codegen");
+      CodeGenPasses.run(**PartOrErr);
+      TimeRecord End = TimeRecord::getCurrentTime(false);
+      Infos[I].CodeGenSeconds = End.getWallTime() - Start.getWallTime();
+    });
+  }
+  CodeGenThreadPool.wait();
+  return Infos;
+}
+
+static void printPartitionReport(ArrayRef<PartitionInfo> Infos) {
+  double Total = 0, Slowest = 0;
+  errs() << "partition  functions  instructions  codegen (s)\n";
+  for (unsigned I = 0, E = Infos.size(); I != E; ++I) {
+    const PartitionInfo &Info = Infos[I];
+    errs() << format("%9u  %9u  %12" PRIu64 "  %11.3f\n", I, Info.Functions,
+                     Info.Instructions, Info.CodeGenSeconds);
+    Total += Info.CodeGenSeconds;
+    Slowest = std::max(Slowest, Info.CodeGenSeconds);
+  }
+  if (Total > 0)
+    errs() << format("slowest partition / mean: %.2f\n",
+                     Slowest * Infos.size() / Total);
+}
+
 int main(int argc, char **argv) {
   // Print a stack trace if we signal out.
   sys::PrintStackTraceOnErrorSignal(argv[0]);
@@ -910,7 +1170,35 @@ int main(int argc, char **argv) {
       OSPtrs.push_back(&OSs.back().os());
     }
 
-    if (!CodeGen.compileOptimized(OSPtrs))
+    if (PartitionReport || BalancePartitions) {
+      if (RestoreGlobalsLinkage)
+        error("-restore-linkage can't be combined with -partition-report or "
+              "-balance-partitions");
+      // LTOCodeGenerator splits the module internally, so take the optimized
+      // module out through bitcode and do the split here instead.
+      SmallString<128> MergedPath;
+      std::error_code EC =
+          sys::fs::createTemporaryFile("llvm-lto-merged", "bc", MergedPath);
+      error(EC, "error creating temporary file");
+      FileRemover RemoveMerged(MergedPath);
+      if (!CodeGen.writeMergedModules(MergedPath))
+        error("writing merged module failed.");
+      CodeGen.resetMergedModule();
+
+      LLVMContext SplitContext;
+      SplitContext.setDiagnosticHandler(diagnosticHandler, nullptr, true);
+      SMDiagnostic Err;
+      std::unique_ptr<Module> Merged =
+          parseIRFile(MergedPath, Err, SplitContext);
+      if (!Merged) {
+        Err.print(argv[0], errs());
+        error("error reading merged module");
+      }
+      std::vector<PartitionInfo> Infos =
+          splitCodeGenWithStats(std::move(Merged), OSPtrs, Options, attrs);
+      if (PartitionReport)
+        printPartitionReport(Infos);
+    } else if (!CodeGen.compileOptimized(OSPtrs))
       // Diagnostic messages should have been printed by the handler.
       error("error compiling the code");
 
@@ -920,6 +1208,10 @@ int main(int argc, char **argv) {
     if (Parallelism != 1)
       error("-j must be specified together with -o");
 
+    if (PartitionReport || BalancePartitions)
+      error("-partition-report and -balance-partitions must be specified "
+            "together with -o");
+
     if (SaveModuleFile)
       error(": -save-merged-module must be specified with -o");
 
@@ -17,13 +17,28 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/LTO/Caching.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/CodeGen/CommandFlags.h"
 #include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
 #include "llvm/LTO/LTO.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/Threading.h"
+#include <atomic>
+#include <mutex>
 
 using namespace llvm;
 using namespace lto;
@@ -48,6 +63,21 @@ static cl::opt<std::string> OutputFilename("o", cl::Required,
 static cl::opt<std::string> CacheDir("cache-dir", cl::desc("Cache Directory"),
                                      cl::value_desc("directory"));
 
+static cl::opt<std::string> IRCacheDir(
+    "ir-cache-dir",
+    cl::desc("Directory for a cache of optimized, not yet code generated, "
+             "modules that is kept valid across codegen option changes"),
+    cl::value_desc("directory"));
+
+static cl::opt<std::string>
+    IRCachePolicy("ir-cache-policy",
+                  cl::desc("Pruning policy for -ir-cache-dir, in the format "
+                           "accepted by parseCachePruningPolicy"),
+                  cl::value_desc("policy"));
+
+static cl::opt<bool> CacheStats("cache-stats",
+                                cl::desc("Print cache hit and miss counts"));
+
 static cl::opt<std::string> OptPipeline("opt-pipeline",
                                         cl::desc("Optimizer Pipeline"),
                                         cl::value_desc("pipeline"));
@@ -126,6 +156,175 @@ template <typename T> static T check(ErrorOr<T> E, std::string Msg) {
   return T();
 }
 
+namespace {
+/// Second cache tier beneath the native object cache, holding each backend
+/// task's module as it leaves the optimizer. Entries are keyed on the
+/// optimizer's input module and the optimization options alone, so a run
+/// that only changes codegen options (-cg-opt-level, -mcpu, -mattr, ...) goes
+/// straight from the cached IR to code generation.
+///
+/// The CPU and features stay out of the key even though the optimizer's cost
+/// models consult them: they do not change what the IR means, so a cached
+/// module is valid for any subtarget of its triple.
+class OptimizedIRCache {
+public:
+  OptimizedIRCache(StringRef Dir, const Config &Conf, AddStreamFn AddStream)
+      : Dir(Dir), CPU(Conf.CPU), Options(Conf.Options), MAttrs(Conf.MAttrs),
+        RelocModel(Conf.RelocModel), CodeModel(Conf.CodeModel),
+        CGOptLevel(Conf.CGOptLevel), CGFileType(Conf.CGFileType),
+        AddStream(std::move(AddStream)) {
+    SHA1 Hasher;
+    Hasher.update(Conf.OptPipeline);
+    Hasher.update(StringRef("\0", 1));
+    Hasher.update(Conf.AAPipeline);
+    Hasher.update(StringRef("\0", 1));
+    // A profile regenerated in place must not reuse IR optimized with the
+    // old one, so hash what is in it rather than where it is. If it cannot
+    // be read, the backend will fail on it anyway.
+    if (!Conf.SampleProfile.empty()) {
+      auto ProfileOrErr = MemoryBuffer::getFile(Conf.SampleProfile);
+      if (ProfileOrErr)
+        Hasher.update((*ProfileOrErr)->getBuffer());
+      else
+        Hasher.update(Conf.SampleProfile);
+    }
+    Hasher.update(StringRef("\0", 1));
+    Hasher.update(utostr(Conf.OptLevel));
+    OptionsHash = Hasher.result();
+  }
+
+  /// Called with the module that is about to be optimized for \p Task. Returns
+  /// false if the task has been completed from the cache.
+  bool lookup(unsigned Task, const Module &M);
+
+  /// Called with the optimized module of a task that missed in lookup().
+  void store(unsigned Task, const Module &M);
+
+  /// Called with the stream the native object cache hands out for a task
+  /// that missed in it. A hit for that task is then written through it, so
+  /// it fills the native cache like a backend run would have.
+  void setNativeStream(unsigned Task, AddStreamFn Stream);
+
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+  /// Hits that filled a native object cache entry.
+  std::atomic<unsigned> NativeFills{0};
+
+private:
+  bool codegen(unsigned Task, MemoryBufferRef BC);
+
+  std::string Dir;
+  std::string OptionsHash;
+  std::string CPU;
+  TargetOptions Options;
+  std::vector<std::string> MAttrs;
+  Reloc::Model RelocModel;
+  CodeModel::Model CodeModel;
+  CodeGenOpt::Level CGOptLevel;
+  TargetMachine::CodeGenFileType CGFileType;
+  AddStreamFn AddStream;
+
+  std::mutex Mutex;
+  DenseMap<unsigned, std::string> PendingPaths;
+  DenseMap<unsigned, AddStreamFn> NativeStreams;
+};
+} // end anonymous namespace
+
+bool OptimizedIRCache::lookup(unsigned Task, const Module &M) {
+  SmallString<0> BC;
+  raw_svector_ostream OS(BC);
+  WriteBitcodeToFile(&M, OS);
+  SHA1 Hasher;
+  Hasher.update(OptionsHash);
+  Hasher.update(BC);
+
+  SmallString<128> Path;
+  sys::path::append(Path, Dir, "llvmcache-ir-" + toHex(Hasher.result()));
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MBOrErr = MemoryBuffer::getFile(Path);
+  if (MBOrErr && codegen(Task, (*MBOrErr)->getMemBufferRef())) {
+    ++Hits;
+    return false;
+  }
+
+  ++Misses;
+  std::lock_guard<std::mutex> Lock(Mutex);
+  PendingPaths[Task] = Path.str();
+  // The backend writes through the native stream it was given itself.
+  NativeStreams.erase(Task);
+  return true;
+}
+
+void OptimizedIRCache::setNativeStream(unsigned Task, AddStreamFn Stream) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  NativeStreams[Task] = std::move(Stream);
+}
+
+void OptimizedIRCache::store(unsigned Task, const Module &M) {
+  std::string Path;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = PendingPaths.find(Task);
+    if (I == PendingPaths.end())
+      return;
+    Path = std::move(I->second);
+    PendingPaths.erase(I);
+  }
+
+  // Write to a temporary file first so that a concurrent reader never sees a
+  // partial entry. A failure here only costs a future cache hit.
+  int FD;
+  SmallString<128> TempPath;
+  if (sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TempPath))
+    return;
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    WriteBitcodeToFile(&M, OS);
+  }
+  if (sys::fs::rename(TempPath, Path))
+    sys::fs::remove(TempPath);
+}
+
+bool OptimizedIRCache::codegen(unsigned Task, MemoryBufferRef BC) {
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MOrErr = parseBitcodeFile(BC, Ctx);
+  if (!MOrErr) {
+    // Treat a damaged entry as a miss and let the backend regenerate it.
+    consumeError(MOrErr.takeError());
+    return false;
+  }
+  Module &M = **MOrErr;
+
+  std::string Msg;
+  const Target *T = TargetRegistry::lookupTarget(M.getTargetTriple(), Msg);
+  if (!T)
+    return false;
+  SubtargetFeatures Features;
+  Features.getDefaultSubtargetFeatures(Triple(M.getTargetTriple()));
+  for (const std::string &A : MAttrs)
+    Features.AddFeature(A);
+  std::unique_ptr<TargetMachine> TM(
+      T->createTargetMachine(M.getTargetTriple(), CPU, Features.getString(),
+                             Options, RelocModel, CodeModel, CGOptLevel));
+
+  AddStreamFn TaskStream = AddStream;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = NativeStreams.find(Task);
+    if (I != NativeStreams.end()) {
+      TaskStream = std::move(I->second);
+      NativeStreams.erase(I);
+      ++NativeFills;
+    }
+  }
+
+  std::unique_ptr<NativeObjectStream> Stream = TaskStream(Task);
+  legacy::PassManager CodeGenPasses;
+  if (TM->addPassesToEmitFile(CodeGenPasses, *Stream->OS, CGFileType))
+    report_fatal_error("Failed to setup codegen");
+  CodeGenPasses.run(M);
+  return true;
+}
+
 static int usage() {
   errs() << "Available subcommands: dump-symtab run\n";
   return 1;
@@ -183,9 +382,15 @@ static int run(int argc, char **argv) {
     Conf.RelocModel = *RM;
   Conf.CodeModel = CMModel;
 
-  if (SaveTemps)
-    check(Conf.addSaveTemps(OutputFilename + "."),
-          "Config::addSaveTemps failed");
+  auto AddStream =
+      [&](size_t Task) -> std::unique_ptr<lto::NativeObjectStream> {
+    std::string Path = OutputFilename + "." + utostr(Task);
+
+    std::error_code EC;
+    auto S = llvm::make_unique<raw_fd_ostream>(Path, EC, sys::fs::F_None);
+    check(EC, Path);
+    return llvm::make_unique<lto::NativeObjectStream>(std::move(S));
+  };
 
   // Optimization remarks.
   Conf.RemarksFilename = OptRemarksOutput;
@@ -220,6 +425,31 @@ static int run(int argc, char **argv) {
   Conf.OverrideTriple = OverrideTriple;
   Conf.DefaultTriple = DefaultTriple;
 
+  // The IR cache keys on and codegens with the options above, so it is set
+  // up once they are final. The regular LTO module is optimized as task 0;
+  // ThinLTO tasks follow it.
+  std::unique_ptr<OptimizedIRCache> IRCache;
+  if (!IRCacheDir.empty()) {
+    check(sys::fs::create_directories(IRCacheDir), IRCacheDir);
+    IRCache = llvm::make_unique<OptimizedIRCache>(IRCacheDir, Conf, AddStream);
+    Conf.PostInternalizeModuleHook = [&](unsigned Task, const Module &M) {
+      return Task != 0 || IRCache->lookup(Task, M);
+    };
+    Conf.PostImportModuleHook = [&](unsigned Task, const Module &M) {
+      return IRCache->lookup(Task, M);
+    };
+    Conf.PostOptModuleHook = [&](unsigned Task, const Module &M) {
+      IRCache->store(Task, M);
+      return true;
+    };
+  }
+
+  // Installed last, so that the temporaries are saved around the IR cache
+  // hooks rather than replaced by them.
+  if (SaveTemps)
+    check(Conf.addSaveTemps(OutputFilename + "."),
+          "Config::addSaveTemps failed");
+
   ThinBackend Backend;
   if (ThinLTODistributedIndexes)
     Backend = createWriteIndexesThinBackend("", "", true, "");
@@ -265,25 +495,43 @@ static int run(int argc, char **argv) {
   if (HasErrors)
     return 1;
 
-  auto AddStream =
-      [&](size_t Task) -> std::unique_ptr<lto::NativeObjectStream> {
-    std::string Path = OutputFilename + "." + utostr(Task);
-
-    std::error_code EC;
-    auto S = llvm::make_unique<raw_fd_ostream>(Path, EC, sys::fs::F_None);
-    check(EC, Path);
-    return llvm::make_unique<lto::NativeObjectStream>(std::move(S));
-  };
-
   auto AddBuffer = [&](size_t Task, std::unique_ptr<MemoryBuffer> MB) {
     *AddStream(Task)->OS << MB->getBuffer();
   };
 
   NativeObjectCache Cache;
-  if (!CacheDir.empty())
-    Cache = check(localCache(CacheDir, AddBuffer), "failed to create cache");
+  std::atomic<unsigned> CacheHits(0), CacheMisses(0);
+  if (!CacheDir.empty()) {
+    NativeObjectCache Local =
+        check(localCache(CacheDir, AddBuffer), "failed to create cache");
+    Cache = [&, Local](unsigned Task, StringRef Key) {
+      AddStreamFn Stream = Local(Task, Key);
+      ++(Stream ? CacheMisses : CacheHits);
+      if (Stream && IRCache)
+        IRCache->setNativeStream(Task, Stream);
+      return Stream;
+    };
+  }
 
   check(Lto.run(AddStream, Cache), "LTO::run failed");
+
+  if (IRCache && !IRCachePolicy.empty()) {
+    CachePruningPolicy Policy =
+        check(parseCachePruningPolicy(IRCachePolicy), "invalid cache policy");
+    pruneCache(IRCacheDir, Policy);
+  }
+
+  if (CacheStats) {
+    if (!CacheDir.empty())
+      errs() << "native object cache: " << CacheHits << " hits, "
+             << CacheMisses << " misses\n";
+    if (!CacheDir.empty() && IRCache)
+      errs() << "native object cache: " << IRCache->NativeFills
+             << " misses filled from the optimized IR cache\n";
+    if (IRCache)
+      errs() << "optimized IR cache: " << IRCache->Hits << " hits, "
+             << IRCache->Misses << " misses\n";
+  }
   return 0;
 }
 
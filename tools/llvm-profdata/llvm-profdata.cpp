@@ -12,6 +12,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/LLVMContext.h"
@@ -24,6 +25,7 @@
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
@@ -32,6 +34,9 @@
 #include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <queue>
 
 using namespace llvm;
 
@@ -118,8 +123,12 @@ typedef SmallVector<WeightedFile, 5> WeightedFileVector;
 struct WriterContext {
   std::mutex Lock;
   InstrProfWriter Writer;
+  /// Whether the profiles read so far are IR level (1) or front-end (0), or
+  /// -1 before the first one. InstrProfWriter::mergeRecordsFromWriter does
+  /// not carry the kind over, so mergeWriterContexts does.
+  int IsIRLevel = -1;
   Error Err;
-  StringRef ErrWhence;
+  std::string ErrWhence;
   std::mutex &ErrLock;
   SmallSet<instrprof_error, 4> &WriterErrorCodes;
 
@@ -156,6 +165,7 @@ static void loadInput(const WeightedFile &Input, WriterContext *WC) {
         std::error_code());
     return;
   }
+  WC->IsIRLevel = IsIRProfile;
 
   for (auto &I : *Reader) {
     const StringRef FuncName = I.Name;
@@ -172,26 +182,443 @@ static void loadInput(const WeightedFile &Input, WriterContext *WC) {
     WC->Err = Reader->getError();
 }
 
+/// Merge all of \p Contexts into the first one with \p Merge, in
+/// ~ lg(Contexts.size()) serial steps.
+template <typename ContextT>
+static void
+mergeContextsTogether(ThreadPool &Pool,
+                      ArrayRef<std::unique_ptr<ContextT>> Contexts,
+                      void (*Merge)(ContextT *Dst, ContextT *Src)) {
+  unsigned Mid = Contexts.size() / 2;
+  unsigned End = Contexts.size();
+  assert(Mid > 0 && "Expected more than one context");
+  do {
+    for (unsigned I = 0; I < Mid; ++I)
+      Pool.async(Merge, Contexts[I].get(), Contexts[I + Mid].get());
+    Pool.wait();
+    if (End & 1) {
+      Pool.async(Merge, Contexts[0].get(), Contexts[End - 1].get());
+      Pool.wait();
+    }
+    End = Mid;
+    Mid /= 2;
+  } while (Mid > 0);
+}
+
+namespace {
+/// Hands the inputs of a merge out to its threads, largest first: one big
+/// file then only holds up the thread reading it, and the biggest files are
+/// not the last ones picked up by an otherwise idle pool.
+class InputQueue {
+  std::vector<const WeightedFile *> Order;
+  std::atomic<size_t> Next;
+
+public:
+  explicit InputQueue(const WeightedFileVector &Inputs) : Next(0) {
+    std::vector<std::pair<uint64_t, const WeightedFile *>> Sizes;
+    for (const WeightedFile &Input : Inputs) {
+      uint64_t Size = 0;
+      if (Input.Filename != "-")
+        sys::fs::file_size(Input.Filename, Size);
+      Sizes.push_back({Size, &Input});
+    }
+    std::stable_sort(Sizes.begin(), Sizes.end(),
+                     [](const std::pair<uint64_t, const WeightedFile *> &A,
+                        const std::pair<uint64_t, const WeightedFile *> &B) {
+                       return A.first > B.first;
+                     });
+    for (const auto &Size : Sizes)
+      Order.push_back(Size.second);
+  }
+
+  /// The next input no thread has claimed yet, or null if there is none.
+  const WeightedFile *next() {
+    size_t I = Next++;
+    return I < Order.size() ? Order[I] : nullptr;
+  }
+};
+}
+
 /// Merge the \p Src writer context into \p Dst.
 static void mergeWriterContexts(WriterContext *Dst, WriterContext *Src) {
+  // If there's a pending hard error, don't do more work.
+  if (Dst->Err)
+    return;
+
+  // A thread may not have read any profile at all, so Dst may not know the
+  // kind yet; take it from Src rather than write an IR level profile out as
+  // a front-end one.
+  if (Src->IsIRLevel != -1) {
+    if (Dst->Writer.setIsIRLevelProfile(Src->IsIRLevel)) {
+      Dst->Err = make_error<StringError>(
+          "Merge IR generated profile with Clang generated profile.",
+          std::error_code());
+      return;
+    }
+    Dst->IsIRLevel = Src->IsIRLevel;
+  }
+
   if (Error E = Dst->Writer.mergeRecordsFromWriter(std::move(Src->Writer)))
     Dst->Err = std::move(E);
 }
 
+namespace {
+/// Per-thread state of a sharded merge: one writer per shard, each holding the
+/// records whose names hash to that shard. All of them are spilled to new
+/// shard files whenever the thread has buffered enough records.
+struct ShardSpiller {
+  std::vector<std::unique_ptr<InstrProfWriter>> Writers;
+  uint64_t Buffered = 0;
+  int IsIRLevel = -1;
+  Error Err;
+  std::string ErrWhence;
+  std::mutex &ErrLock;
+  SmallSet<instrprof_error, 4> &WriterErrorCodes;
+
+  ShardSpiller(unsigned NumShards, std::mutex &ErrLock,
+               SmallSet<instrprof_error, 4> &WriterErrorCodes)
+      : Writers(NumShards), Err(Error::success()), ErrLock(ErrLock),
+        WriterErrorCodes(WriterErrorCodes) {}
+};
+
+/// The indexed profiles spilled to disk so far, by shard.
+struct ShardFiles {
+  std::mutex Lock;
+  std::vector<WeightedFileVector> Files;
+
+  explicit ShardFiles(unsigned NumShards) : Files(NumShards) {}
+
+  /// Delete every shard file spilled so far.
+  void removeAll() {
+    for (WeightedFileVector &Shard : Files) {
+      for (const WeightedFile &File : Shard)
+        sys::fs::remove(File.Filename);
+      Shard.clear();
+    }
+  }
+};
+}
+
+/// Write every non-empty shard writer of \p S out to a new shard file.
+static void spillShards(ShardSpiller *S, ShardFiles *Files) {
+  for (unsigned K = 0, E = S->Writers.size(); K != E; ++K) {
+    if (!S->Writers[K])
+      continue;
+    SmallString<128> Path;
+    std::error_code EC =
+        sys::fs::createTemporaryFile("profdata-shard", "profdata", Path);
+    if (!EC) {
+      raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+      if (!EC) {
+        S->Writers[K]->write(OS);
+        OS.close();
+        if (OS.has_error()) {
+          OS.clear_error();
+          EC = make_error_code(errc::io_error);
+        }
+      }
+      if (EC)
+        sys::fs::remove(Path);
+    }
+    if (EC) {
+      SmallString<128> TempDir;
+      sys::path::system_temp_directory(/*ErasedOnReboot=*/true, TempDir);
+      S->Err = errorCodeToError(EC);
+      S->ErrWhence = TempDir.str();
+      return;
+    }
+    S->Writers[K].reset();
+    std::lock_guard<std::mutex> Guard(Files->Lock);
+    Files->Files[K].push_back({Path.str(), 1});
+  }
+  S->Buffered = 0;
+}
+
+/// Like loadInput, but route each record to the writer of its shard, with the
+/// input's weight already applied, and spill once \p SpillRecords records
+/// are buffered.
+static void spillInput(const WeightedFile &Input, ShardSpiller *S,
+                       ShardFiles *Files, uint64_t SpillRecords) {
+  // If there's a pending hard error, don't do more work.
+  if (S->Err)
+    return;
+
+  S->ErrWhence = Input.Filename;
+
+  auto ReaderOrErr = InstrProfReader::create(Input.Filename);
+  if (Error E = ReaderOrErr.takeError()) {
+    // Skip the empty profiles by returning sliently.
+    instrprof_error IPE = InstrProfError::take(std::move(E));
+    if (IPE != instrprof_error::empty_raw_profile)
+      S->Err = make_error<InstrProfError>(IPE);
+    return;
+  }
+
+  auto Reader = std::move(ReaderOrErr.get());
+  bool IsIRProfile = Reader->isIRLevelProfile();
+  if (S->IsIRLevel != -1 && S->IsIRLevel != IsIRProfile) {
+    S->Err = make_error<StringError>(
+        "Merge IR generated profile with Clang generated profile.",
+        std::error_code());
+    return;
+  }
+  S->IsIRLevel = IsIRProfile;
+
+  for (auto &I : *Reader) {
+    const StringRef FuncName = I.Name;
+    std::unique_ptr<InstrProfWriter> &Writer =
+        S->Writers[IndexedInstrProf::ComputeHash(FuncName) %
+                   S->Writers.size()];
+    if (!Writer) {
+      // Shards are never sparse: a zero record may still meet non-zero ones
+      // from another shard file.
+      Writer = llvm::make_unique<InstrProfWriter>(/*Sparse=*/false);
+      consumeError(Writer->setIsIRLevelProfile(IsIRProfile));
+    }
+    if (Error E = Writer->addRecord(std::move(I), Input.Weight)) {
+      // Only show hint the first time an error occurs.
+      instrprof_error IPE = InstrProfError::take(std::move(E));
+      std::unique_lock<std::mutex> ErrGuard{S->ErrLock};
+      bool firstTime = S->WriterErrorCodes.insert(IPE).second;
+      handleMergeWriterError(make_error<InstrProfError>(IPE), Input.Filename,
+                             FuncName, firstTime);
+    }
+    ++S->Buffered;
+  }
+  if (Reader->hasError()) {
+    S->Err = Reader->getError();
+    return;
+  }
+
+  if (S->Buffered >= SpillRecords)
+    spillShards(S, Files);
+}
+
+/// Merge \p Inputs through \p NumShards on-disk shards. Records are split by
+/// function name hash, so the shards hold disjoint sets of functions and each
+/// can be merged on its own. This is not a bounded-memory merge: the result
+/// holds the whole merged profile, next to up to \p NumThreads shards being
+/// merged. It only removes the factor of \p NumThreads that comes from every
+/// thread holding its own copy of the merged profile.
+static std::unique_ptr<WriterContext>
+mergeThroughShards(const WeightedFileVector &Inputs, bool OutputSparse,
+                   unsigned NumThreads, unsigned NumShards,
+                   uint64_t SpillRecords, std::mutex &ErrorLock,
+                   SmallSet<instrprof_error, 4> &WriterErrorCodes) {
+  ShardFiles Files(NumShards);
+  SmallVector<std::unique_ptr<ShardSpiller>, 4> Spillers;
+  for (unsigned I = 0; I < NumThreads; ++I)
+    Spillers.emplace_back(llvm::make_unique<ShardSpiller>(
+        NumShards, ErrorLock, WriterErrorCodes));
+
+  ThreadPool Pool(NumThreads);
+  InputQueue Queue(Inputs);
+  for (unsigned I = 0; I < NumThreads; ++I)
+    Pool.async([&, I]() {
+      ShardSpiller *S = Spillers[I].get();
+      while (const WeightedFile *Input = Queue.next())
+        spillInput(*Input, S, &Files, SpillRecords);
+      if (!S->Err)
+        spillShards(S, &Files);
+    });
+  Pool.wait();
+
+  // Every thread checked its own inputs for mixed profile kinds; check that
+  // the threads agree with each other too.
+  int IsIRLevel = -1;
+  for (std::unique_ptr<ShardSpiller> &S : Spillers) {
+    if (S->Err) {
+      Files.removeAll();
+      exitWithError(std::move(S->Err), S->ErrWhence);
+    }
+    if (S->IsIRLevel == -1)
+      continue;
+    if (IsIRLevel != -1 && IsIRLevel != S->IsIRLevel) {
+      Files.removeAll();
+      exitWithError("Merge IR generated profile with Clang generated profile.");
+    }
+    IsIRLevel = S->IsIRLevel;
+  }
+  Spillers.clear();
+
+  // Merge each shard separately and move the result into the final context.
+  // The shards share no functions, so that last step never merges records.
+  // Every shard file is deleted once read, so an error is reported against
+  // the shard rather than a file that no longer exists.
+  auto Result =
+      llvm::make_unique<WriterContext>(OutputSparse, ErrorLock,
+                                       WriterErrorCodes);
+  if (IsIRLevel != -1) {
+    consumeError(Result->Writer.setIsIRLevelProfile(IsIRLevel));
+    Result->IsIRLevel = IsIRLevel;
+  }
+  std::mutex ResultLock;
+  for (unsigned K = 0; K < NumShards; ++K)
+    Pool.async([&, K]() {
+      WriterContext Shard(/*IsSparse=*/false, ErrorLock, WriterErrorCodes);
+      for (const WeightedFile &File : Files.Files[K]) {
+        loadInput(File, &Shard);
+        sys::fs::remove(File.Filename);
+      }
+      std::lock_guard<std::mutex> Guard(ResultLock);
+      if (Shard.Err) {
+        if (!Result->Err) {
+          Result->Err = std::move(Shard.Err);
+          Result->ErrWhence = ("shard " + Twine(K) + " of " +
+                               Twine(NumShards) + " of the inputs")
+                                  .str();
+        } else {
+          consumeError(std::move(Shard.Err));
+        }
+        return;
+      }
+      if (!Result->Err)
+        mergeWriterContexts(Result.get(), &Shard);
+    });
+  Pool.wait();
+  return Result;
+}
+
+namespace {
+/// A function ranked by the largest of its counters.
+struct HotFunction {
+  uint64_t MaxCount;
+  uint64_t Hash;
+  std::string Name;
+
+  bool operator>(const HotFunction &RHS) const {
+    return MaxCount > RHS.MaxCount;
+  }
+};
+} // end anonymous namespace
+
+static const char TopFunctionsHeader[] = "# llvm-profdata top functions v1";
+
+static std::string getTopFunctionsPath(StringRef ProfileFilename) {
+  return (ProfileFilename + ".top").str();
+}
+
+/// Find the \p N functions in \p Reader with the largest counts, hottest
+/// first. Only the best N seen so far are kept, in a min-heap on the count.
+static std::vector<HotFunction> findHotFunctions(InstrProfReader &Reader,
+                                                 StringRef Whence, size_t N) {
+  std::priority_queue<HotFunction, std::vector<HotFunction>,
+                      std::greater<HotFunction>>
+      Heap;
+  for (const InstrProfRecord &Func : Reader) {
+    if (!N)
+      break;
+    uint64_t MaxCount = 0;
+    for (uint64_t Count : Func.Counts)
+      MaxCount = std::max(MaxCount, Count);
+    if (Heap.size() == N) {
+      if (MaxCount <= Heap.top().MaxCount)
+        continue;
+      Heap.pop();
+    }
+    Heap.push({MaxCount, Func.Hash, Func.Name});
+  }
+  if (Reader.hasError())
+    exitWithError(Reader.getError(), Whence);
+
+  std::vector<HotFunction> Hot(Heap.size());
+  for (size_t I = Hot.size(); I > 0; --I) {
+    Hot[I - 1] = Heap.top();
+    Heap.pop();
+  }
+  return Hot;
+}
+
+/// Precompute the top \p N functions of the profile in \p Filename into a
+/// file next to it, so show -topn does not have to scan the whole profile.
+static void writeTopFunctions(StringRef Filename, size_t N) {
+  auto ReaderOrErr = InstrProfReader::create(Filename);
+  if (Error E = ReaderOrErr.takeError())
+    exitWithError(std::move(E), Filename);
+  std::vector<HotFunction> Hot =
+      findHotFunctions(*ReaderOrErr.get(), Filename, N);
+
+  std::string TopPath = getTopFunctionsPath(Filename);
+  std::error_code EC;
+  raw_fd_ostream OS(TopPath, EC, sys::fs::F_Text);
+  if (EC)
+    exitWithErrorCode(EC, TopPath);
+  // Record how many functions were asked for: a profile with fewer functions
+  // than that still answers any query up to N.
+  OS << TopFunctionsHeader << "\n" << N << "\n";
+  for (const HotFunction &F : Hot)
+    OS << F.MaxCount << " " << format("0x%016" PRIx64, F.Hash) << " "
+       << F.Name << "\n";
+}
+
+/// Read the top \p N functions precomputed for the profile in \p Filename.
+/// Return false if there are none, they are older than the profile, or too
+/// few were precomputed.
+static bool readTopFunctions(StringRef Filename, size_t N,
+                             std::vector<HotFunction> &Hot) {
+  std::string TopPath = getTopFunctionsPath(Filename);
+  sys::fs::file_status ProfileStatus, TopStatus;
+  if (sys::fs::status(Filename, ProfileStatus) ||
+      sys::fs::status(TopPath, TopStatus) ||
+      TopStatus.getLastModificationTime() <
+          ProfileStatus.getLastModificationTime())
+    return false;
+
+  auto BufOrError = MemoryBuffer::getFile(TopPath);
+  if (!BufOrError)
+    return false;
+  line_iterator LineIt(**BufOrError, /*SkipBlanks=*/true);
+  if (LineIt.is_at_eof() || *LineIt != TopFunctionsHeader)
+    return false;
+  size_t Precomputed;
+  if ((++LineIt).is_at_eof() || LineIt->getAsInteger(10, Precomputed) ||
+      Precomputed < N)
+    return false;
+
+  std::vector<HotFunction> Result;
+  for (++LineIt; !LineIt.is_at_eof() && Result.size() < N; ++LineIt) {
+    StringRef Count, Hash, Name;
+    std::tie(Count, Name) = LineIt->split(' ');
+    std::tie(Hash, Name) = Name.split(' ');
+    HotFunction F;
+    if (Count.getAsInteger(10, F.MaxCount) || Hash.getAsInteger(0, F.Hash) ||
+        Name.empty())
+      return false;
+    F.Name = Name;
+    Result.push_back(std::move(F));
+  }
+  Hot = std::move(Result);
+  return true;
+}
+
 static void mergeInstrProfile(const WeightedFileVector &Inputs,
                               StringRef OutputFilename,
                               ProfileFormat OutputFormat, bool OutputSparse,
-                              unsigned NumThreads) {
+                              unsigned NumThreads, unsigned NumShards,
+                              uint64_t SpillRecords) {
   if (OutputFilename.compare("-") == 0)
     exitWithError("Cannot write indexed profdata format to stdout.");
 
   if (OutputFormat != PF_Binary && OutputFormat != PF_Text)
     exitWithError("Unknown format is specified.");
 
+  // The output may also be one of the inputs, as when merging new profiles
+  // into the output of an earlier merge in place. Write to a temporary file
+  // next to it then, and only replace it once everything has been read. That
+  // file is created after the merge, so a failed merge leaves nothing behind.
+  bool OutputIsInput =
+      std::any_of(Inputs.begin(), Inputs.end(), [&](const WeightedFile &WF) {
+        bool Same = false;
+        return !sys::fs::equivalent(WF.Filename, OutputFilename, Same) && Same;
+      });
   std::error_code EC;
-  raw_fd_ostream Output(OutputFilename.data(), EC, sys::fs::F_None);
-  if (EC)
-    exitWithErrorCode(EC, OutputFilename);
+  SmallString<128> OutputPath(OutputFilename);
+  std::unique_ptr<raw_fd_ostream> Output;
+  if (!OutputIsInput) {
+    Output = llvm::make_unique<raw_fd_ostream>(OutputPath, EC, sys::fs::F_None);
+    if (EC)
+      exitWithErrorCode(EC, OutputPath);
+  }
 
   std::mutex ErrorLock;
   SmallSet<instrprof_error, 4> WriterErrorCodes;
@@ -201,43 +628,34 @@ static void mergeInstrProfile(const WeightedFileVector &Inputs,
     NumThreads = std::max(1U, std::min(std::thread::hardware_concurrency(),
                                        unsigned(Inputs.size() / 2)));
 
-  // Initialize the writer contexts.
+  // Initialize the writer contexts. A sharded merge makes its own.
   SmallVector<std::unique_ptr<WriterContext>, 4> Contexts;
-  for (unsigned I = 0; I < NumThreads; ++I)
-    Contexts.emplace_back(llvm::make_unique<WriterContext>(
-        OutputSparse, ErrorLock, WriterErrorCodes));
-
-  if (NumThreads == 1) {
+  if (!NumShards)
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Contexts.emplace_back(llvm::make_unique<WriterContext>(
+          OutputSparse, ErrorLock, WriterErrorCodes));
+
+  if (NumShards) {
+    Contexts.push_back(mergeThroughShards(Inputs, OutputSparse, NumThreads,
+                                          NumShards, SpillRecords, ErrorLock,
+                                          WriterErrorCodes));
+  } else if (NumThreads == 1) {
     for (const auto &Input : Inputs)
       loadInput(Input, Contexts[0].get());
   } else {
     ThreadPool Pool(NumThreads);
 
-    // Load the inputs in parallel (N/NumThreads serial steps).
-    unsigned Ctx = 0;
-    for (const auto &Input : Inputs) {
-      Pool.async(loadInput, Input, Contexts[Ctx].get());
-      Ctx = (Ctx + 1) % NumThreads;
-    }
+    // Load the inputs in parallel. Every thread fills its own context from a
+    // shared queue, so one large input only holds up the thread reading it.
+    InputQueue Queue(Inputs);
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Pool.async([&, I]() {
+        while (const WeightedFile *Input = Queue.next())
+          loadInput(*Input, Contexts[I].get());
+      });
     Pool.wait();
 
-    // Merge the writer contexts together (~ lg(NumThreads) serial steps).
-    unsigned Mid = Contexts.size() / 2;
-    unsigned End = Contexts.size();
-    assert(Mid > 0 && "Expected more than one context");
-    do {
-      for (unsigned I = 0; I < Mid; ++I)
-        Pool.async(mergeWriterContexts, Contexts[I].get(),
-                   Contexts[I + Mid].get());
-      Pool.wait();
-      if (End & 1) {
-        Pool.async(mergeWriterContexts, Contexts[0].get(),
-                   Contexts[End - 1].get());
-        Pool.wait();
-      }
-      End = Mid;
-      Mid /= 2;
-    } while (Mid > 0);
+    mergeContextsTogether<WriterContext>(Pool, Contexts, mergeWriterContexts);
   }
 
   // Handle deferred hard errors encountered during merging.
@@ -245,20 +663,106 @@ static void mergeInstrProfile(const WeightedFileVector &Inputs,
     if (WC->Err)
       exitWithError(std::move(WC->Err), WC->ErrWhence);
 
+  if (OutputIsInput) {
+    EC = sys::fs::createUniqueFile(OutputFilename + "-%%%%%%", OutputPath);
+    if (EC)
+      exitWithErrorCode(EC, OutputFilename);
+    Output = llvm::make_unique<raw_fd_ostream>(OutputPath, EC, sys::fs::F_None);
+    if (EC) {
+      sys::fs::remove(OutputPath);
+      exitWithErrorCode(EC, OutputPath);
+    }
+  }
+
   InstrProfWriter &Writer = Contexts[0]->Writer;
   if (OutputFormat == PF_Text)
-    Writer.writeText(Output);
+    Writer.writeText(*Output);
   else
-    Writer.write(Output);
+    Writer.write(*Output);
+
+  if (OutputIsInput) {
+    Output->close();
+    EC = sys::fs::rename(OutputPath, OutputFilename);
+    if (EC) {
+      sys::fs::remove(OutputPath);
+      exitWithErrorCode(EC, OutputFilename);
+    }
+  }
 }
 
 static sampleprof::SampleProfileFormat FormatMap[] = {
     sampleprof::SPF_None, sampleprof::SPF_Text, sampleprof::SPF_Binary,
     sampleprof::SPF_GCC};
 
+namespace {
+/// Keep track of merged sample profiles and reported errors.
+struct SampleWriterContext {
+  LLVMContext Context;
+  StringMap<sampleprof::FunctionSamples> ProfileMap;
+  // The readers own the function names referenced from the merged samples,
+  // so they are kept until the merged profile has been written.
+  SmallVector<std::unique_ptr<sampleprof::SampleProfileReader>, 5> Readers;
+  std::error_code EC;
+  StringRef ErrWhence;
+  std::mutex &ErrLock;
+
+  SampleWriterContext(std::mutex &ErrLock) : ErrLock(ErrLock) {}
+};
+}
+
+/// Merge \p Samples, read from \p Whence, into \p WC's profile for \p FName.
+static void addSamples(SampleWriterContext *WC, StringRef FName,
+                       const sampleprof::FunctionSamples &Samples,
+                       uint64_t Weight, StringRef Whence) {
+  sampleprof_error Result = WC->ProfileMap[FName].merge(Samples, Weight);
+  if (Result != sampleprof_error::success) {
+    std::error_code EC = make_error_code(Result);
+    std::lock_guard<std::mutex> ErrGuard(WC->ErrLock);
+    handleMergeWriterError(errorCodeToError(EC), Whence, FName);
+  }
+}
+
+/// Load a sample profile into a writer context.
+static void loadSampleInput(const WeightedFile &Input,
+                            SampleWriterContext *WC) {
+  using namespace sampleprof;
+  // If there's a pending hard error, don't do more work.
+  if (WC->EC)
+    return;
+
+  WC->ErrWhence = Input.Filename;
+  auto ReaderOrErr = SampleProfileReader::create(Input.Filename, WC->Context);
+  if (std::error_code EC = ReaderOrErr.getError()) {
+    WC->EC = EC;
+    return;
+  }
+
+  WC->Readers.push_back(std::move(ReaderOrErr.get()));
+  const auto Reader = WC->Readers.back().get();
+  if (std::error_code EC = Reader->read()) {
+    WC->EC = EC;
+    return;
+  }
+
+  StringMap<FunctionSamples> &Profiles = Reader->getProfiles();
+  for (StringMap<FunctionSamples>::iterator I = Profiles.begin(),
+                                            E = Profiles.end();
+       I != E; ++I)
+    addSamples(WC, I->first(), I->second, Input.Weight, Input.Filename);
+}
+
+/// Merge the \p Src sample writer context into \p Dst.
+static void mergeSampleWriterContexts(SampleWriterContext *Dst,
+                                      SampleWriterContext *Src) {
+  for (auto &I : Src->ProfileMap)
+    addSamples(Dst, I.first(), I.second, 1, "");
+  Src->ProfileMap.clear();
+}
+
 static void mergeSampleProfile(const WeightedFileVector &Inputs,
                                StringRef OutputFilename,
-                               ProfileFormat OutputFormat) {
+                               ProfileFormat OutputFormat,
+                               unsigned NumThreads) {
   using namespace sampleprof;
   auto WriterOrErr =
       SampleProfileWriter::create(OutputFilename, FormatMap[OutputFormat]);
@@ -266,37 +770,47 @@ static void mergeSampleProfile(const WeightedFileVector &Inputs,
     exitWithErrorCode(EC, OutputFilename);
 
   auto Writer = std::move(WriterOrErr.get());
-  StringMap<FunctionSamples> ProfileMap;
-  SmallVector<std::unique_ptr<sampleprof::SampleProfileReader>, 5> Readers;
-  LLVMContext Context;
-  for (const auto &Input : Inputs) {
-    auto ReaderOrErr = SampleProfileReader::create(Input.Filename, Context);
-    if (std::error_code EC = ReaderOrErr.getError())
-      exitWithErrorCode(EC, Input.Filename);
-
-    // We need to keep the readers around until after all the files are
-    // read so that we do not lose the function names stored in each
-    // reader's memory. The function names are needed to write out the
-    // merged profile map.
-    Readers.push_back(std::move(ReaderOrErr.get()));
-    const auto Reader = Readers.back().get();
-    if (std::error_code EC = Reader->read())
-      exitWithErrorCode(EC, Input.Filename);
-
-    StringMap<FunctionSamples> &Profiles = Reader->getProfiles();
-    for (StringMap<FunctionSamples>::iterator I = Profiles.begin(),
-                                              E = Profiles.end();
-         I != E; ++I) {
-      StringRef FName = I->first();
-      FunctionSamples &Samples = I->second;
-      sampleprof_error Result = ProfileMap[FName].merge(Samples, Input.Weight);
-      if (Result != sampleprof_error::success) {
-        std::error_code EC = make_error_code(Result);
-        handleMergeWriterError(errorCodeToError(EC), Input.Filename, FName);
-      }
-    }
+  std::mutex ErrorLock;
+
+  // If NumThreads is not specified, auto-detect a good default.
+  if (NumThreads == 0)
+    NumThreads = std::max(1U, std::min(std::thread::hardware_concurrency(),
+                                       unsigned(Inputs.size() / 2)));
+
+  SmallVector<std::unique_ptr<SampleWriterContext>, 4> Contexts;
+  for (unsigned I = 0; I < NumThreads; ++I)
+    Contexts.emplace_back(llvm::make_unique<SampleWriterContext>(ErrorLock));
+
+  if (NumThreads == 1) {
+    for (const auto &Input : Inputs)
+      loadSampleInput(Input, Contexts[0].get());
+  } else {
+    ThreadPool Pool(NumThreads);
+
+    // Load the inputs in parallel, each thread taking the next input from a
+    // shared queue, then merge the contexts pairwise.
+    InputQueue Queue(Inputs);
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Pool.async([&, I]() {
+        while (const WeightedFile *Input = Queue.next())
+          loadSampleInput(*Input, Contexts[I].get());
+      });
+    Pool.wait();
+
+    // A failed context would otherwise be merged as if it were complete.
+    for (std::unique_ptr<SampleWriterContext> &WC : Contexts)
+      if (WC->EC)
+        exitWithErrorCode(WC->EC, WC->ErrWhence);
+
+    mergeContextsTogether<SampleWriterContext>(Pool, Contexts,
+                                               mergeSampleWriterContexts);
   }
-  Writer->write(ProfileMap);
+
+  for (std::unique_ptr<SampleWriterContext> &WC : Contexts)
+    if (WC->EC)
+      exitWithErrorCode(WC->EC, WC->ErrWhence);
+
+  Writer->write(Contexts[0]->ProfileMap);
 }
 
 static WeightedFile parseWeightedFile(const StringRef &WeightedFilename) {
@@ -413,6 +927,18 @@ static int merge_main(int argc, const char *argv[]) {
       cl::desc("Number of merge threads to use (default: autodetect)"));
   cl::alias NumThreadsA("j", cl::desc("Alias for --num-threads"),
                         cl::aliasopt(NumThreads));
+  cl::opt<unsigned> NumShards(
+      "shards", cl::init(0),
+      cl::desc("Merge through this many on-disk shards split by function "
+               "name. The merged profile is still held in memory once; this "
+               "only avoids one copy per thread (only meaningful for -instr)"));
+  cl::opt<uint64_t> ShardSpillRecords(
+      "shard-spill-records", cl::init(1 << 16), cl::Hidden,
+      cl::desc("Records each thread buffers before spilling to the shards"));
+  cl::opt<unsigned> TopFunctions(
+      "top-functions", cl::init(0), cl::value_desc("N"),
+      cl::desc("Precompute the N functions with the largest counts into "
+               "<output>.top for show -topn (only meaningful for -instr)"));
 
   cl::ParseCommandLineOptions(argc, argv, "LLVM profile data merger\n");
 
@@ -437,11 +963,14 @@ static int merge_main(int argc, const char *argv[]) {
     return 0;
   }
 
-  if (ProfileKind == instr)
+  if (ProfileKind == instr) {
     mergeInstrProfile(WeightedInputs, OutputFilename, OutputFormat,
-                      OutputSparse, NumThreads);
-  else
-    mergeSampleProfile(WeightedInputs, OutputFilename, OutputFormat);
+                      OutputSparse, NumThreads, NumShards, ShardSpillRecords);
+    if (TopFunctions)
+      writeTopFunctions(OutputFilename, TopFunctions);
+  } else
+    mergeSampleProfile(WeightedInputs, OutputFilename, OutputFormat,
+                       NumThreads);
 
   return 0;
 }
@@ -496,6 +1025,101 @@ static void showValueSitesStats(raw_fd_ostream &OS, uint32_t VK,
   }
 }
 
+/// Print the details of one function record read through \p Reader.
+static void showFunction(const InstrProfRecord &Func, InstrProfReader &Reader,
+                         bool ShowCounts, bool ShowIndirectCallTargets,
+                         bool ShowMemOPSizes,
+                         std::vector<ValueSitesStats> &VPStats,
+                         raw_fd_ostream &OS) {
+  bool IsIRInstr = Reader.isIRLevelProfile();
+  OS << "  " << Func.Name << ":\n"
+     << "    Hash: " << format("0x%016" PRIx64, Func.Hash) << "\n"
+     << "    Counters: " << Func.Counts.size() << "\n";
+  if (!IsIRInstr)
+    OS << "    Function count: " << Func.Counts[0] << "\n";
+
+  if (ShowIndirectCallTargets)
+    OS << "    Indirect Call Site Count: "
+       << Func.getNumValueSites(IPVK_IndirectCallTarget) << "\n";
+
+  uint32_t NumMemOPCalls = Func.getNumValueSites(IPVK_MemOPSize);
+  if (ShowMemOPSizes && NumMemOPCalls > 0)
+    OS << "    Number of Memory Intrinsics Calls: " << NumMemOPCalls << "\n";
+
+  if (ShowCounts) {
+    OS << "    Block counts: [";
+    size_t Start = (IsIRInstr ? 0 : 1);
+    for (size_t I = Start, E = Func.Counts.size(); I < E; ++I) {
+      OS << (I == Start ? "" : ", ") << Func.Counts[I];
+    }
+    OS << "]\n";
+  }
+
+  if (ShowIndirectCallTargets) {
+    OS << "    Indirect Target Results:\n";
+    traverseAllValueSites(Func, IPVK_IndirectCallTarget,
+                          VPStats[IPVK_IndirectCallTarget], OS,
+                          &(Reader.getSymtab()));
+  }
+
+  if (ShowMemOPSizes && NumMemOPCalls > 0) {
+    OS << "    Memory Instrinsic Size Results:\n";
+    traverseAllValueSites(Func, IPVK_MemOPSize, VPStats[IPVK_MemOPSize], OS,
+                          nullptr);
+  }
+}
+
+/// Show the records of the function named exactly \p FuncName, looked up
+/// through the on-disk hash table of an indexed profile. No other record is
+/// read, so this stays fast on profiles of any size.
+static int showIndexedFunction(const std::string &Filename, StringRef FuncName,
+                               bool ShowCounts, bool ShowIndirectCallTargets,
+                               bool ShowMemOPSizes, raw_fd_ostream &OS) {
+  auto ReaderOrErr = IndexedInstrProfReader::create(Filename);
+  if (Error E = ReaderOrErr.takeError())
+    exitWithError(std::move(E), Filename);
+  auto Reader = std::move(ReaderOrErr.get());
+
+  ArrayRef<InstrProfRecord> Records;
+  if (Error E = Reader->getRecords(FuncName, Records)) {
+    instrprof_error IPE = InstrProfError::take(std::move(E));
+    if (IPE != instrprof_error::unknown_function)
+      exitWithError(make_error<InstrProfError>(IPE), Filename);
+    OS << "Function not found: " << FuncName << "\n";
+    return 1;
+  }
+
+  int NumVPKind = IPVK_Last - IPVK_First + 1;
+  std::vector<ValueSitesStats> VPStats(NumVPKind);
+  OS << "Counters:\n";
+  for (const InstrProfRecord &Func : Records)
+    showFunction(Func, *Reader, ShowCounts, ShowIndirectCallTargets,
+                 ShowMemOPSizes, VPStats, OS);
+  OS << "Functions shown: " << Records.size() << "\n";
+  return 0;
+}
+
+/// Show the \p N functions with the largest counts, from the list merge
+/// precomputed with -top-functions if it is up to date, or else by scanning
+/// the profile.
+static int showTopFunctions(const std::string &Filename, size_t N,
+                            raw_fd_ostream &OS) {
+  std::vector<HotFunction> Hot;
+  if (!readTopFunctions(Filename, N, Hot)) {
+    auto ReaderOrErr = InstrProfReader::create(Filename);
+    if (Error E = ReaderOrErr.takeError())
+      exitWithError(std::move(E), Filename);
+    Hot = findHotFunctions(*ReaderOrErr.get(), Filename, N);
+  }
+
+  OS << "Top " << N << " functions by maximum count:\n";
+  for (const HotFunction &F : Hot)
+    OS << "  " << F.Name << ":\n"
+       << "    Hash: " << format("0x%016" PRIx64, F.Hash) << "\n"
+       << "    Maximum count: " << F.MaxCount << "\n";
+  return 0;
+}
+
 static int showInstrProfile(const std::string &Filename, bool ShowCounts,
                             bool ShowIndirectCallTargets, bool ShowMemOPSizes,
                             bool ShowDetailedSummary,
@@ -513,7 +1137,6 @@ static int showInstrProfile(const std::string &Filename, bool ShowCounts,
     exitWithError(std::move(E), Filename);
 
   auto Reader = std::move(ReaderOrErr.get());
-  bool IsIRInstr = Reader->isIRLevelProfile();
   size_t ShownFunctions = 0;
   int NumVPKind = IPVK_Last - IPVK_First + 1;
   std::vector<ValueSitesStats> VPStats(NumVPKind);
@@ -540,42 +1163,8 @@ static int showInstrProfile(const std::string &Filename, bool ShowCounts,
 
       ++ShownFunctions;
 
-      OS << "  " << Func.Name << ":\n"
-         << "    Hash: " << format("0x%016" PRIx64, Func.Hash) << "\n"
-         << "    Counters: " << Func.Counts.size() << "\n";
-      if (!IsIRInstr)
-        OS << "    Function count: " << Func.Counts[0] << "\n";
-
-      if (ShowIndirectCallTargets)
-        OS << "    Indirect Call Site Count: "
-           << Func.getNumValueSites(IPVK_IndirectCallTarget) << "\n";
-
-      uint32_t NumMemOPCalls = Func.getNumValueSites(IPVK_MemOPSize);
-      if (ShowMemOPSizes && NumMemOPCalls > 0)
-        OS << "    Number of Memory Intrinsics Calls: " << NumMemOPCalls
-           << "\n";
-
-      if (ShowCounts) {
-        OS << "    Block counts: [";
-        size_t Start = (IsIRInstr ? 0 : 1);
-        for (size_t I = Start, E = Func.Counts.size(); I < E; ++I) {
-          OS << (I == Start ? "" : ", ") << Func.Counts[I];
-        }
-        OS << "]\n";
-      }
-
-      if (ShowIndirectCallTargets) {
-        OS << "    Indirect Target Results:\n";
-        traverseAllValueSites(Func, IPVK_IndirectCallTarget,
-                              VPStats[IPVK_IndirectCallTarget], OS,
-                              &(Reader->getSymtab()));
-      }
-
-      if (ShowMemOPSizes && NumMemOPCalls > 0) {
-        OS << "    Memory Instrinsic Size Results:\n";
-        traverseAllValueSites(Func, IPVK_MemOPSize, VPStats[IPVK_MemOPSize], OS,
-                              nullptr);
-      }
+      showFunction(Func, *Reader, ShowCounts, ShowIndirectCallTargets,
+                   ShowMemOPSizes, VPStats, OS);
     }
   }
   if (Reader->hasError())
@@ -664,6 +1253,13 @@ static int show_main(int argc, const char *argv[]) {
                                  cl::desc("Details for every function"));
   cl::opt<std::string> ShowFunction("function",
                                     cl::desc("Details for matching functions"));
+  cl::opt<std::string> LookupFunction(
+      "lookup", cl::value_desc("function"),
+      cl::desc("Details for the function with exactly this name, looked up "
+               "directly in an indexed profile"));
+  cl::opt<unsigned> TopN("topn", cl::init(0), cl::value_desc("N"),
+                         cl::desc("Show the N functions with the largest "
+                                  "counts"));
 
   cl::opt<std::string> OutputFilename("output", cl::value_desc("output"),
                                       cl::init("-"), cl::desc("Output file"));
@@ -687,6 +1283,18 @@ static int show_main(int argc, const char *argv[]) {
   if (ShowAllFunctions && !ShowFunction.empty())
     errs() << "warning: -function argument ignored: showing all functions\n";
 
+  if (!LookupFunction.empty() || TopN) {
+    if (ProfileKind != instr)
+      exitWithError("-lookup and -topn are only supported for "
+                    "instrumentation profiles.");
+    if (!LookupFunction.empty() && TopN)
+      exitWithError("-lookup and -topn cannot be used together.");
+    if (TopN)
+      return showTopFunctions(Filename, TopN, OS);
+    return showIndexedFunction(Filename, LookupFunction, ShowCounts,
+                               ShowIndirectCallTargets, ShowMemOPSizes, OS);
+  }
+
   std::vector<uint32_t> Cutoffs(DetailedSummaryCutoffs.begin(),
                                 DetailedSummaryCutoffs.end());
   if (ProfileKind == instr)
@@ -17,7 +17,10 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Bitcode/BitcodeWriterPass.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/LLVMContext.h"
@@ -26,10 +29,22 @@
 #include "llvm/IR/Verifier.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errno.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include <map>
+
+#ifdef LLVM_ON_UNIX
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace llvm;
 using namespace opt_tool;
@@ -47,6 +62,61 @@ static cl::opt<std::string>
                         "pipeline for handling managed aliasing queries"),
                cl::Hidden);
 
+namespace {
+/// A -passes pipeline parsed into a module pass manager, together with the
+/// pass builder and analysis managers it runs with.
+struct PassPipelineState {
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  ModulePassManager MPM;
+
+  explicit PassPipelineState(TargetMachine *TM)
+      : PB(TM), LAM(DebugPM), FAM(DebugPM), CGAM(DebugPM), MAM(DebugPM),
+        MPM(DebugPM) {}
+
+  /// Register the analyses and parse \p PassPipeline onto the end of MPM,
+  /// reporting any failure to \p ErrOS.
+  bool initialize(StringRef Arg0, StringRef PassPipeline, bool VerifyEachPass,
+                  raw_ostream &ErrOS) {
+    // Specially handle the alias analysis manager so that we can register
+    // a custom pipeline of AA passes with it.
+    AAManager AA;
+    if (!PB.parseAAPipeline(AA, AAPipeline)) {
+      ErrOS << Arg0 << ": unable to parse AA pipeline description.\n";
+      return false;
+    }
+
+    // Register the AA manager first so that our version is the one used.
+    FAM.registerPass([&] { return std::move(AA); });
+
+    // Register all the basic analyses with the managers.
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    if (!PB.parsePassPipeline(MPM, PassPipeline, VerifyEachPass, DebugPM)) {
+      ErrOS << Arg0 << ": unable to parse pass pipeline description.\n";
+      return false;
+    }
+    return true;
+  }
+
+  /// Drop every analysis result, so nothing computed for one module outlives
+  /// it.
+  void clearAnalyses() {
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+  }
+};
+} // end anonymous namespace
+
 bool llvm::runPassPipeline(StringRef Arg0, Module &M,
                            TargetMachine *TM, tool_output_file *Out,
                            StringRef PassPipeline, OutputKind OK,
@@ -54,40 +124,13 @@ bool llvm::runPassPipeline(StringRef Arg0, Module &M,
                            bool ShouldPreserveAssemblyUseListOrder,
                            bool ShouldPreserveBitcodeUseListOrder,
                            bool EmitSummaryIndex, bool EmitModuleHash) {
-  PassBuilder PB(TM);
-
-  // Specially handle the alias analysis manager so that we can register
-  // a custom pipeline of AA passes with it.
-  AAManager AA;
-  if (!PB.parseAAPipeline(AA, AAPipeline)) {
-    errs() << Arg0 << ": unable to parse AA pipeline description.\n";
-    return false;
-  }
-
-  LoopAnalysisManager LAM(DebugPM);
-  FunctionAnalysisManager FAM(DebugPM);
-  CGSCCAnalysisManager CGAM(DebugPM);
-  ModuleAnalysisManager MAM(DebugPM);
-
-  // Register the AA manager first so that our version is the one used.
-  FAM.registerPass([&] { return std::move(AA); });
-
-  // Register all the basic analyses with the managers.
-  PB.registerModuleAnalyses(MAM);
-  PB.registerCGSCCAnalyses(CGAM);
-  PB.registerFunctionAnalyses(FAM);
-  PB.registerLoopAnalyses(LAM);
-  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
-
-  ModulePassManager MPM(DebugPM);
+  PassPipelineState State(TM);
+  ModulePassManager &MPM = State.MPM;
   if (VK > VK_NoVerifier)
     MPM.addPass(VerifierPass());
 
-  if (!PB.parsePassPipeline(MPM, PassPipeline, VK == VK_VerifyEachPass,
-                            DebugPM)) {
-    errs() << Arg0 << ": unable to parse pass pipeline description.\n";
+  if (!State.initialize(Arg0, PassPipeline, VK == VK_VerifyEachPass, errs()))
     return false;
-  }
 
   if (VK > VK_NoVerifier)
     MPM.addPass(VerifierPass());
@@ -110,10 +153,260 @@ bool llvm::runPassPipeline(StringRef Arg0, Module &M,
   cl::PrintOptionValues();
 
   // Now that we have all of the passes ready, run them.
-  MPM.run(M, MAM);
+  MPM.run(M, State.MAM);
 
   // Declare success.
   if (OK != OK_NoOutput)
     Out->keep();
   return true;
 }
+
+//===----------------------------------------------------------------------===//
+// Compile server
+//===----------------------------------------------------------------------===//
+
+#ifdef LLVM_ON_UNIX
+
+namespace {
+enum ServerOp : uint8_t { SO_Optimize = 0, SO_Shutdown = 1 };
+enum ServerStatus : uint8_t { SS_Success = 0, SS_Error = 1 };
+
+// Requests larger than this are refused before anything is allocated for
+// them, since the sizes come straight from the client.
+const uint32_t MaxPipelineSize = 1 << 20;
+const uint64_t MaxBitcodeSize = uint64_t(1) << 30;
+
+/// Optimizes request modules with pipelines that are parsed once per
+/// (pipeline, target machine) and kept for later requests.
+class CompileServer {
+  StringRef Arg0;
+  std::function<TargetMachine *(Module &)> PrepareModule;
+  VerifierKind VK;
+  bool ShouldPreserveBitcodeUseListOrder;
+  std::map<std::pair<std::string, TargetMachine *>,
+           std::unique_ptr<PassPipelineState>>
+      Pipelines;
+
+public:
+  CompileServer(StringRef Arg0,
+                std::function<TargetMachine *(Module &)> PrepareModule,
+                VerifierKind VK, bool ShouldPreserveBitcodeUseListOrder)
+      : Arg0(Arg0), PrepareModule(std::move(PrepareModule)), VK(VK),
+        ShouldPreserveBitcodeUseListOrder(ShouldPreserveBitcodeUseListOrder) {}
+
+  /// Optimize \p Bitcode with \p PassPipeline. On success the optimized
+  /// bitcode is written to \p Result, otherwise an error message is.
+  bool optimize(StringRef PassPipeline, StringRef Bitcode,
+                SmallVectorImpl<char> &Result);
+};
+} // end anonymous namespace
+
+bool CompileServer::optimize(StringRef PassPipeline, StringRef Bitcode,
+                             SmallVectorImpl<char> &Result) {
+  raw_svector_ostream OS(Result);
+
+  // A context per request keeps types and constants from piling up.
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> ModuleOrErr =
+      parseBitcodeFile(MemoryBufferRef(Bitcode, "<request>"), Context);
+  if (!ModuleOrErr) {
+    OS << toString(ModuleOrErr.takeError());
+    return false;
+  }
+  Module &M = **ModuleOrErr;
+  TargetMachine *TM = PrepareModule(M);
+
+  // The verifier pass aborts on a broken module, which would take the server
+  // down with it, so the module is verified here instead. -verify-each is not
+  // honored for the same reason.
+  if (VK > VK_NoVerifier && verifyModule(M, &OS)) {
+    OS << "error: input module is broken!";
+    return false;
+  }
+
+  auto &State = Pipelines[std::make_pair(PassPipeline.str(), TM)];
+  if (!State) {
+    auto NewState = llvm::make_unique<PassPipelineState>(TM);
+    if (!NewState->initialize(Arg0, PassPipeline, false, OS))
+      return false;
+    State = std::move(NewState);
+  }
+
+  State->MPM.run(M, State->MAM);
+  State->clearAnalyses();
+
+  if (VK > VK_NoVerifier && verifyModule(M, &OS)) {
+    OS << "error: optimized module is broken!";
+    return false;
+  }
+
+  WriteBitcodeToFile(&M, OS, ShouldPreserveBitcodeUseListOrder);
+  return true;
+}
+
+static bool readAll(int FD, void *Buf, size_t Size) {
+  char *P = static_cast<char *>(Buf);
+  while (Size) {
+    ssize_t N = ::read(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool writeAll(int FD, const void *Buf, size_t Size) {
+  const char *P = static_cast<const char *>(Buf);
+#ifdef MSG_NOSIGNAL
+  const int Flags = MSG_NOSIGNAL;
+#else
+  const int Flags = 0;
+#endif
+  while (Size) {
+    ssize_t N = ::send(FD, P, Size, Flags);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+template <typename T> static bool readInt(int FD, T &Value) {
+  if (!readAll(FD, &Value, sizeof(T)))
+    return false;
+  Value = support::endian::byte_swap<T, support::little>(Value);
+  return true;
+}
+
+template <typename T> static bool writeInt(int FD, T Value) {
+  Value = support::endian::byte_swap<T, support::little>(Value);
+  return writeAll(FD, &Value, sizeof(T));
+}
+
+/// Reply to a request with an error \p Message.
+static bool writeError(int FD, StringRef Message) {
+  return writeInt<uint8_t>(FD, SS_Error) &&
+         writeInt<uint64_t>(FD, Message.size()) &&
+         writeAll(FD, Message.data(), Message.size());
+}
+
+/// Serve requests from one client until it disconnects. Returns true if the
+/// client asked the server to shut down.
+static bool serveClient(int FD, CompileServer &Server) {
+  while (true) {
+    uint8_t Op;
+    uint32_t PipelineSize;
+    uint64_t BitcodeSize;
+    if (!readAll(FD, &Op, 1))
+      return false;
+    if (Op == SO_Shutdown) {
+      writeInt<uint8_t>(FD, SS_Success);
+      writeInt<uint64_t>(FD, 0);
+      return true;
+    }
+    if (Op != SO_Optimize || !readInt(FD, PipelineSize))
+      return false;
+    // The rest of an oversized request is not read, so the connection cannot
+    // be used for further requests after the reply.
+    if (PipelineSize > MaxPipelineSize) {
+      writeError(FD, "error: pass pipeline is too large");
+      return false;
+    }
+    std::string Pipeline(PipelineSize, '\0');
+    if (!readAll(FD, &Pipeline[0], PipelineSize) || !readInt(FD, BitcodeSize))
+      return false;
+    if (BitcodeSize > MaxBitcodeSize) {
+      writeError(FD, "error: input module is too large");
+      return false;
+    }
+    std::string Input(BitcodeSize, '\0');
+    if (!readAll(FD, &Input[0], BitcodeSize))
+      return false;
+
+    SmallVector<char, 0> Result;
+    bool Success = Server.optimize(Pipeline, Input, Result);
+    if (!writeInt<uint8_t>(FD, Success ? SS_Success : SS_Error) ||
+        !writeInt<uint64_t>(FD, Result.size()) ||
+        !writeAll(FD, Result.data(), Result.size()))
+      return false;
+  }
+}
+
+bool llvm::runCompileServer(
+    StringRef Arg0, StringRef SocketPath,
+    std::function<TargetMachine *(Module &)> PrepareModule, VerifierKind VK,
+    bool ShouldPreserveBitcodeUseListOrder) {
+  sockaddr_un Addr;
+  if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+    errs() << Arg0 << ": socket path is too long: " << SocketPath << '\n';
+    return false;
+  }
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  memcpy(Addr.sun_path, SocketPath.data(), SocketPath.size());
+
+  int Listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Listener < 0) {
+    errs() << Arg0 << ": socket: " << sys::StrError() << '\n';
+    return false;
+  }
+  // A socket file left behind by an earlier server would make bind fail, so
+  // remove it. Anything else at that path is left alone.
+  sys::fs::file_status Status;
+  if (!sys::fs::status(SocketPath, Status, /*follow=*/false) &&
+      sys::fs::exists(Status)) {
+    if (Status.type() != sys::fs::file_type::socket_file) {
+      errs() << Arg0 << ": " << SocketPath << ": exists and is not a socket\n";
+      ::close(Listener);
+      return false;
+    }
+    sys::fs::remove(SocketPath);
+  }
+  if (::bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) ||
+      ::listen(Listener, SOMAXCONN)) {
+    errs() << Arg0 << ": " << SocketPath << ": " << sys::StrError() << '\n';
+    ::close(Listener);
+    return false;
+  }
+
+  CompileServer Server(Arg0, std::move(PrepareModule), VK,
+                       ShouldPreserveBitcodeUseListOrder);
+  bool Shutdown = false;
+  while (!Shutdown) {
+    int Client = ::accept(Listener, nullptr, nullptr);
+    if (Client < 0) {
+      if (errno == EINTR)
+        continue;
+      errs() << Arg0 << ": accept: " << sys::StrError() << '\n';
+      break;
+    }
+#ifdef SO_NOSIGPIPE
+    int One = 1;
+    ::setsockopt(Client, SOL_SOCKET, SO_NOSIGPIPE, &One, sizeof(One));
+#endif
+    Shutdown = serveClient(Client, Server);
+    ::close(Client);
+  }
+
+  ::close(Listener);
+  sys::fs::remove(SocketPath);
+  return Shutdown;
+}
+
+#else
+
+bool llvm::runCompileServer(
+    StringRef Arg0, StringRef SocketPath,
+    std::function<TargetMachine *(Module &)> PrepareModule, VerifierKind VK,
+    bool ShouldPreserveBitcodeUseListOrder) {
+  errs() << Arg0 << ": -serve requires Unix domain sockets\n";
+  return false;
+}
+
+#endif // LLVM_ON_UNIX
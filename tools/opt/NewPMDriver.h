@@ -21,6 +21,8 @@
 #ifndef LLVM_TOOLS_OPT_NEWPMDRIVER_H
 #define LLVM_TOOLS_OPT_NEWPMDRIVER_H
 
+#include <functional>
+
 namespace llvm {
 class StringRef;
 class LLVMContext;
@@ -54,6 +56,24 @@ bool runPassPipeline(StringRef Arg0, Module &M,
                      bool ShouldPreserveAssemblyUseListOrder,
                      bool ShouldPreserveBitcodeUseListOrder,
                      bool EmitSummaryIndex, bool EmitModuleHash);
+
+/// \brief Serve optimization requests on the Unix domain socket at
+/// \p SocketPath until a client asks the server to shut down.
+///
+/// Each request is one byte of operation (0 to optimize, 1 to shut down)
+/// followed, for an optimize request, by a 32-bit pipeline length, the
+/// -passes style pipeline text, a 64-bit bitcode length and the bitcode. The
+/// reply is a status byte (0 on success), a 64-bit length and either the
+/// optimized bitcode or an error message. All integers are little-endian, and
+/// a client may send any number of requests over one connection.
+///
+/// Pipelines are parsed once per pipeline text and target machine and reused
+/// by later requests. \p PrepareModule applies the command line overrides to
+/// a request's module and returns the target machine to optimize it for.
+bool runCompileServer(StringRef Arg0, StringRef SocketPath,
+                      std::function<TargetMachine *(Module &)> PrepareModule,
+                      opt_tool::VerifierKind VK,
+                      bool ShouldPreserveBitcodeUseListOrder);
 }
 
 #endif
@@ -0,0 +1,315 @@
+//===- PassProfiler.cpp - Per-pass time, memory and IR size profiler ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// \brief Records the wall time, memory growth and IR size change of every
+/// pass opt runs, and writes them out as Chrome trace events.
+///
+//===----------------------------------------------------------------------===//
+#include "PassProfiler.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CallGraphSCCPass.h"
+#include "llvm/Analysis/LoopPass.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+using namespace opt_tool;
+
+/// Peak resident set size of the process in bytes, or 0 where it is not known.
+static uint64_t getPeakRSS() {
+#ifdef LLVM_ON_UNIX
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return Usage.ru_maxrss;
+#else
+  return uint64_t(Usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+static void addSize(IRSize &Size, const BasicBlock &BB) {
+  Size.Instructions += BB.size();
+  ++Size.BasicBlocks;
+}
+
+static IRSize getSize(const Function &F) {
+  IRSize Size;
+  for (const BasicBlock &BB : F)
+    addSize(Size, BB);
+  return Size;
+}
+
+static IRSize getSize(const Module &M) {
+  IRSize Size;
+  for (const Function &F : M)
+    for (const BasicBlock &BB : F)
+      addSize(Size, BB);
+  return Size;
+}
+
+static void getProbeAnalysisUsage(AnalysisUsage &AU,
+                                  ArrayRef<AnalysisID> Required) {
+  for (AnalysisID ID : Required)
+    AU.addRequiredID(ID);
+  AU.setPreservesAll();
+}
+
+namespace {
+
+// Each probe reports to the profiler before (IsEnd false) or after (IsEnd
+// true) the pass it brackets, and changes and invalidates nothing. A begin
+// probe also requires whatever its pass requires. The pass manager then
+// schedules those passes ahead of the probe rather than between it and the
+// pass, so they are not charged to the pass, and a loop pass shares its
+// LPPassManager with the probe.
+
+struct ModuleProbe : public ModulePass {
+  static char ID;
+  PassProfiler &Profiler;
+  unsigned PassIdx;
+  bool IsEnd;
+  SmallVector<AnalysisID, 4> Required;
+
+  ModuleProbe(PassProfiler &Profiler, unsigned PassIdx, bool IsEnd,
+              ArrayRef<AnalysisID> Required)
+      : ModulePass(ID), Profiler(Profiler), PassIdx(PassIdx), IsEnd(IsEnd),
+        Required(Required.begin(), Required.end()) {}
+
+  bool runOnModule(Module &M) override {
+    if (IsEnd)
+      Profiler.end(PassIdx, &M, M.getModuleIdentifier(), getSize(M));
+    else
+      Profiler.begin(PassIdx, &M, getSize(M));
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    getProbeAnalysisUsage(AU, Required);
+  }
+
+  StringRef getPassName() const override { return "Pass profiler probe"; }
+};
+
+struct SCCProbe : public CallGraphSCCPass {
+  static char ID;
+  PassProfiler &Profiler;
+  unsigned PassIdx;
+  bool IsEnd;
+  SmallVector<AnalysisID, 4> Required;
+
+  SCCProbe(PassProfiler &Profiler, unsigned PassIdx, bool IsEnd,
+           ArrayRef<AnalysisID> Required)
+      : CallGraphSCCPass(ID), Profiler(Profiler), PassIdx(PassIdx),
+        IsEnd(IsEnd), Required(Required.begin(), Required.end()) {}
+
+  bool runOnSCC(CallGraphSCC &SCC) override {
+    IRSize Size;
+    StringRef Name = "<external>";
+    for (CallGraphNode *Node : SCC) {
+      Function *F = Node->getFunction();
+      if (!F)
+        continue;
+      if (Name == "<external>")
+        Name = F->getName();
+      for (const BasicBlock &BB : *F)
+        addSize(Size, BB);
+    }
+    // The SCC object itself is reused, so key on its first node instead.
+    const void *Unit = *SCC.begin();
+    if (IsEnd)
+      Profiler.end(PassIdx, Unit, Name, Size);
+    else
+      Profiler.begin(PassIdx, Unit, Size);
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    getProbeAnalysisUsage(AU, Required);
+  }
+
+  StringRef getPassName() const override { return "Pass profiler probe"; }
+};
+
+struct FunctionProbe : public FunctionPass {
+  static char ID;
+  PassProfiler &Profiler;
+  unsigned PassIdx;
+  bool IsEnd;
+  SmallVector<AnalysisID, 4> Required;
+
+  FunctionProbe(PassProfiler &Profiler, unsigned PassIdx, bool IsEnd,
+                ArrayRef<AnalysisID> Required)
+      : FunctionPass(ID), Profiler(Profiler), PassIdx(PassIdx), IsEnd(IsEnd),
+        Required(Required.begin(), Required.end()) {}
+
+  bool runOnFunction(Function &F) override {
+    if (IsEnd)
+      Profiler.end(PassIdx, &F, F.getName(), getSize(F));
+    else
+      Profiler.begin(PassIdx, &F, getSize(F));
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    getProbeAnalysisUsage(AU, Required);
+  }
+
+  StringRef getPassName() const override { return "Pass profiler probe"; }
+};
+
+struct LoopProbe : public LoopPass {
+  static char ID;
+  PassProfiler &Profiler;
+  unsigned PassIdx;
+  bool IsEnd;
+  SmallVector<AnalysisID, 4> Required;
+
+  LoopProbe(PassProfiler &Profiler, unsigned PassIdx, bool IsEnd,
+            ArrayRef<AnalysisID> Required)
+      : LoopPass(ID), Profiler(Profiler), PassIdx(PassIdx), IsEnd(IsEnd),
+        Required(Required.begin(), Required.end()) {}
+
+  bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+    IRSize Size;
+    for (const BasicBlock *BB : L->blocks())
+      addSize(Size, *BB);
+    if (IsEnd)
+      Profiler.end(PassIdx, L, L->getHeader()->getParent()->getName(), Size);
+    else
+      Profiler.begin(PassIdx, L, Size);
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    getProbeAnalysisUsage(AU, Required);
+  }
+
+  StringRef getPassName() const override { return "Pass profiler probe"; }
+};
+
+} // end anonymous namespace
+
+char ModuleProbe::ID = 0;
+char SCCProbe::ID = 0;
+char FunctionProbe::ID = 0;
+char LoopProbe::ID = 0;
+
+template <typename ProbeT>
+static std::pair<Pass *, Pass *> makeProbes(PassProfiler &Profiler,
+                                            unsigned PassIdx, Pass &P) {
+  AnalysisUsage AU;
+  P.getAnalysisUsage(AU);
+  return {new ProbeT(Profiler, PassIdx, false, AU.getRequiredSet()),
+          new ProbeT(Profiler, PassIdx, true, None)};
+}
+
+PassProfiler::PassProfiler() : Origin(TimeRecord::getCurrentTime()) {}
+
+std::pair<Pass *, Pass *> PassProfiler::createProbes(Pass &P) {
+  // Immutable passes never run, so there is nothing to measure.
+  if (P.getAsImmutablePass())
+    return {nullptr, nullptr};
+
+  unsigned PassIdx = PassNames.size();
+  switch (P.getPassKind()) {
+  case PT_Module:
+    PassNames.push_back(P.getPassName());
+    return makeProbes<ModuleProbe>(*this, PassIdx, P);
+  case PT_CallGraphSCC:
+    PassNames.push_back(P.getPassName());
+    return makeProbes<SCCProbe>(*this, PassIdx, P);
+  case PT_Function:
+    PassNames.push_back(P.getPassName());
+    return makeProbes<FunctionProbe>(*this, PassIdx, P);
+  case PT_Loop:
+    PassNames.push_back(P.getPassName());
+    return makeProbes<LoopProbe>(*this, PassIdx, P);
+  default:
+    return {nullptr, nullptr};
+  }
+}
+
+void PassProfiler::begin(unsigned PassIdx, const void *Unit, IRSize Size) {
+  Snapshot &S = Open[{PassIdx, Unit}];
+  S.Size = Size;
+  S.PeakRSS = getPeakRSS();
+  S.Time = TimeRecord::getCurrentTime(true);
+}
+
+void PassProfiler::end(unsigned PassIdx, const void *Unit, StringRef UnitName,
+                       IRSize Size) {
+  TimeRecord Now = TimeRecord::getCurrentTime(false);
+  auto I = Open.find({PassIdx, Unit});
+  // The pass replaced or deleted the unit it started on.
+  if (I == Open.end())
+    return;
+  const Snapshot &S = I->second;
+
+  Event E;
+  E.PassIdx = PassIdx;
+  E.UnitName = UnitName;
+  E.Start = S.Time.getWallTime() - Origin.getWallTime();
+  E.Duration = Now.getWallTime() - S.Time.getWallTime();
+  E.MemDelta = int64_t(Now.getMemUsed()) - int64_t(S.Time.getMemUsed());
+  E.PeakRSSDelta = int64_t(getPeakRSS()) - int64_t(S.PeakRSS);
+  E.Before = S.Size;
+  E.After = Size;
+  Events.push_back(std::move(E));
+  Open.erase(I);
+}
+
+static void writeJSONString(raw_ostream &OS, StringRef S) {
+  OS << '"';
+  for (unsigned char C : S) {
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if (C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+  OS << '"';
+}
+
+void PassProfiler::writeTrace(raw_ostream &OS) const {
+  OS << "{\"traceEvents\":[";
+  const char *Sep = "\n";
+  for (const Event &E : Events) {
+    OS << Sep << "{\"name\":";
+    writeJSONString(OS, PassNames[E.PassIdx]);
+    OS << ",\"cat\":\"pass\",\"ph\":\"X\",\"pid\":1,\"tid\":0"
+       << ",\"ts\":" << format("%.3f", E.Start * 1e6)
+       << ",\"dur\":" << format("%.3f", E.Duration * 1e6)
+       << ",\"args\":{\"unit\":";
+    writeJSONString(OS, E.UnitName);
+    OS << ",\"mem_delta\":" << E.MemDelta
+       << ",\"peak_rss_delta\":" << E.PeakRSSDelta
+       << ",\"insts_before\":" << E.Before.Instructions
+       << ",\"insts_after\":" << E.After.Instructions
+       << ",\"blocks_before\":" << E.Before.BasicBlocks
+       << ",\"blocks_after\":" << E.After.BasicBlocks << "}}";
+    Sep = ",\n";
+  }
+  OS << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
@@ -0,0 +1,113 @@
+//===- PassProfiler.h - Per-pass time, memory and IR size profiler --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// \brief Records the wall time, memory growth and IR size change of every
+/// pass opt runs, and writes them out as Chrome trace events.
+///
+//===----------------------------------------------------------------------===//
+#ifndef LLVM_TOOLS_OPT_PASSPROFILER_H
+#define LLVM_TOOLS_OPT_PASSPROFILER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Timer.h"
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+
+class Pass;
+class raw_ostream;
+
+namespace opt_tool {
+
+/// Instruction and basic block count of the IR unit a pass ran on.
+struct IRSize {
+  uint64_t Instructions = 0;
+  uint64_t BasicBlocks = 0;
+};
+
+/// Collects one trace event per pass invocation. Passes are bracketed by probe
+/// passes of the same kind (see createProbes), so each module, SCC, function
+/// or loop a pass runs on produces its own event. The passes a pass requires
+/// are scheduled ahead of its first probe, so their time is not charged to
+/// it; only a function analysis a module pass computes on the fly still is.
+class PassProfiler {
+public:
+  PassProfiler();
+
+  /// Create the probes to run immediately before and after \p P, or a pair of
+  /// nulls if \p P is not a kind of pass that is profiled. The first probe
+  /// requires everything \p P requires.
+  std::pair<Pass *, Pass *> createProbes(Pass &P);
+
+  /// Called by the probes around pass \p PassIdx running on \p Unit.
+  void begin(unsigned PassIdx, const void *Unit, IRSize Size);
+  void end(unsigned PassIdx, const void *Unit, StringRef UnitName,
+           IRSize Size);
+
+  /// Write everything recorded so far in the Chrome trace event format.
+  void writeTrace(raw_ostream &OS) const;
+
+private:
+  struct Snapshot {
+    TimeRecord Time;
+    uint64_t PeakRSS;
+    IRSize Size;
+  };
+
+  struct Event {
+    unsigned PassIdx;
+    std::string UnitName;
+    double Start;
+    double Duration;
+    int64_t MemDelta;
+    int64_t PeakRSSDelta;
+    IRSize Before;
+    IRSize After;
+  };
+
+  TimeRecord Origin;
+  std::vector<std::string> PassNames;
+  DenseMap<std::pair<unsigned, const void *>, Snapshot> Open;
+  std::vector<Event> Events;
+};
+
+/// A legacy pass manager that brackets every pass added to it with probes
+/// from \p Profiler, or behaves exactly like PMT when \p Profiler is null.
+template <typename PMT> class ProfilingPassManager : public PMT {
+  PassProfiler *Profiler;
+
+public:
+  template <typename... ArgTs>
+  explicit ProfilingPassManager(PassProfiler *Profiler, ArgTs &&... Args)
+      : PMT(std::forward<ArgTs>(Args)...), Profiler(Profiler) {}
+
+  void add(Pass *P) override {
+    if (!Profiler)
+      return PMT::add(P);
+    // The pass manager may delete P in add(), so create the probes first.
+    // Adding the first probe schedules the passes P requires, so nothing is
+    // left to schedule between it and P.
+    std::pair<Pass *, Pass *> Probes = Profiler->createProbes(*P);
+    if (Probes.first)
+      PMT::add(Probes.first);
+    PMT::add(P);
+    if (Probes.second)
+      PMT::add(Probes.second);
+  }
+};
+
+} // namespace opt_tool
+} // namespace llvm
+
+#endif // LLVM_TOOLS_OPT_PASSPROFILER_H
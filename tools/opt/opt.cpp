@@ -15,6 +15,9 @@
 #include "BreakpointPrinter.h"
 #include "NewPMDriver.h"
 #include "PassPrinters.h"
+#include "PassProfiler.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/CallGraphSCCPass.h"
@@ -40,6 +43,7 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/LineIterator.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/PluginLoader.h"
 #include "llvm/Support/PrettyStackTrace.h"
@@ -48,6 +52,8 @@
 #include "llvm/Support/SystemUtils.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/YAMLTraits.h"
 #include "llvm/Target/TargetMachine.h"
@@ -56,6 +62,7 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
+#include <atomic>
 #include <memory>
 using namespace llvm;
 using namespace opt_tool;
@@ -246,6 +253,26 @@ static cl::opt<std::string>
                     cl::desc("YAML output filename for pass remarks"),
                     cl::value_desc("filename"));
 
+static cl::opt<std::string> ProfilePassesFilename(
+    "profile-passes", cl::value_desc("filename"),
+    cl::desc("Record wall time, memory growth and instruction/basic block "
+             "counts around every pass and write them as Chrome trace "
+             "events to <filename>"));
+
+static cl::opt<std::string> BatchFilename(
+    "batch", cl::value_desc("filename"),
+    cl::desc("Optimize each '<input> <output>' pair listed one per line in "
+             "<filename> with the configured pipeline, on -j threads"));
+
+static cl::opt<unsigned>
+    BatchJobs("j", cl::init(0), cl::value_desc("N"),
+              cl::desc("Number of threads for -batch (default: one per core)"));
+
+static cl::opt<std::string> ServeSocket(
+    "serve", cl::value_desc("socket path"),
+    cl::desc("Run as a compile server, optimizing bitcode sent with a -passes "
+             "pipeline over a Unix domain socket at <socket path>"));
+
 static inline void addPass(legacy::PassManagerBase &PM, Pass *P) {
   // Add the pass to the pass manager...
   PM.add(P);
@@ -346,6 +373,351 @@ static TargetMachine* GetTargetMachine(Triple TheTriple, StringRef CPUStr,
                                         CMModel, GetCodeGenOptLevel());
 }
 
+/// Returns true if any of -O0, -O1, -O2, -O3, -Os or -Oz was given.
+static bool hasStandardOptLevel() {
+  return OptLevelO0 || OptLevelO1 || OptLevelO2 || OptLevelOs || OptLevelOz ||
+         OptLevelO3;
+}
+
+/// Add the analyses describing the target of \p ModuleTriple.
+static void addTargetAnalyses(legacy::PassManagerBase &Passes,
+                              const Triple &ModuleTriple, TargetMachine *TM) {
+  // Add an appropriate TargetLibraryInfo pass for the module's triple.
+  TargetLibraryInfoImpl TLII(ModuleTriple);
+
+  // The -disable-simplify-libcalls flag actually disables all builtin optzns.
+  if (DisableSimplifyLibCalls)
+    TLII.disableAllFunctions();
+  Passes.add(new TargetLibraryInfoWrapperPass(TLII));
+
+  // Add internal analysis passes from the target machine.
+  Passes.add(createTargetTransformInfoWrapperPass(TM ? TM->getTargetIRAnalysis()
+                                                     : TargetIRAnalysis()));
+}
+
+/// Add the passes named on the command line to \p Passes, with the standard
+/// pipelines requested by -O<n> and -std-link-opts added in their command line
+/// positions. \p FPasses must be non-null if hasStandardOptLevel(). With
+/// \p AnalysisOut, each pass is followed by a printer for its analysis.
+static void addPipelinePasses(const char *argv0,
+                              legacy::PassManagerBase &Passes,
+                              legacy::FunctionPassManager *FPasses,
+                              TargetMachine *TM, raw_ostream *AnalysisOut) {
+  // Each standard pipeline is added once: before the first pass that follows
+  // it on the command line, or else at the end.
+  bool AddStandardLinkOpts = StandardLinkOpts;
+  bool AddO0 = OptLevelO0, AddO1 = OptLevelO1, AddO2 = OptLevelO2;
+  bool AddOs = OptLevelOs, AddOz = OptLevelOz, AddO3 = OptLevelO3;
+
+  for (unsigned i = 0; i < PassList.size(); ++i) {
+    if (AddStandardLinkOpts &&
+        StandardLinkOpts.getPosition() < PassList.getPosition(i)) {
+      AddStandardLinkPasses(Passes);
+      AddStandardLinkOpts = false;
+    }
+
+    if (AddO0 && OptLevelO0.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 0, 0);
+      AddO0 = false;
+    }
+
+    if (AddO1 && OptLevelO1.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 1, 0);
+      AddO1 = false;
+    }
+
+    if (AddO2 && OptLevelO2.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 2, 0);
+      AddO2 = false;
+    }
+
+    if (AddOs && OptLevelOs.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 2, 1);
+      AddOs = false;
+    }
+
+    if (AddOz && OptLevelOz.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 2, 2);
+      AddOz = false;
+    }
+
+    if (AddO3 && OptLevelO3.getPosition() < PassList.getPosition(i)) {
+      AddOptimizationPasses(Passes, *FPasses, TM, 3, 0);
+      AddO3 = false;
+    }
+
+    const PassInfo *PassInf = PassList[i];
+    Pass *P = nullptr;
+    if (PassInf->getTargetMachineCtor())
+      P = PassInf->getTargetMachineCtor()(TM);
+    else if (PassInf->getNormalCtor())
+      P = PassInf->getNormalCtor()();
+    else
+      errs() << argv0 << ": cannot create pass: "
+             << PassInf->getPassName() << "\n";
+    if (P) {
+      PassKind Kind = P->getPassKind();
+      addPass(Passes, P);
+
+      if (AnalysisOut) {
+        switch (Kind) {
+        case PT_BasicBlock:
+          Passes.add(createBasicBlockPassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        case PT_Region:
+          Passes.add(createRegionPassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        case PT_Loop:
+          Passes.add(createLoopPassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        case PT_Function:
+          Passes.add(createFunctionPassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        case PT_CallGraphSCC:
+          Passes.add(createCallGraphPassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        default:
+          Passes.add(createModulePassPrinter(PassInf, *AnalysisOut, Quiet));
+          break;
+        }
+      }
+    }
+
+    if (PrintEachXForm)
+      Passes.add(
+          createPrintModulePass(errs(), "", PreserveAssemblyUseListOrder));
+  }
+
+  if (AddStandardLinkOpts)
+    AddStandardLinkPasses(Passes);
+
+  if (AddO0)
+    AddOptimizationPasses(Passes, *FPasses, TM, 0, 0);
+
+  if (AddO1)
+    AddOptimizationPasses(Passes, *FPasses, TM, 1, 0);
+
+  if (AddO2)
+    AddOptimizationPasses(Passes, *FPasses, TM, 2, 0);
+
+  if (AddOs)
+    AddOptimizationPasses(Passes, *FPasses, TM, 2, 1);
+
+  if (AddOz)
+    AddOptimizationPasses(Passes, *FPasses, TM, 2, 2);
+
+  if (AddO3)
+    AddOptimizationPasses(Passes, *FPasses, TM, 3, 0);
+}
+
+/// Add the pass writing the optimized module to \p OS, in the format chosen
+/// on the command line.
+static void addOutputPass(legacy::PassManagerBase &Passes, raw_ostream &OS,
+                          raw_ostream *ThinLinkOS) {
+  if (OutputAssembly) {
+    if (EmitSummaryIndex)
+      report_fatal_error("Text output is incompatible with -module-summary");
+    if (EmitModuleHash)
+      report_fatal_error("Text output is incompatible with -module-hash");
+    Passes.add(createPrintModulePass(OS, "", PreserveAssemblyUseListOrder));
+  } else if (OutputThinLTOBC)
+    Passes.add(createWriteThinLTOBitcodePass(OS, ThinLinkOS));
+  else
+    Passes.add(createBitcodeWriterPass(OS, PreserveBitcodeUseListOrder,
+                                       EmitSummaryIndex, EmitModuleHash));
+}
+
+/// Target machines by triple, for tools that optimize many modules.
+typedef StringMap<std::unique_ptr<TargetMachine>> TargetMachineCache;
+
+/// Return the target machine for \p ModuleTriple from \p Machines, creating
+/// it on first use. Null if the triple has no registered target.
+static TargetMachine *getCachedTargetMachine(TargetMachineCache &Machines,
+                                             const Triple &ModuleTriple,
+                                             StringRef CPUStr,
+                                             StringRef FeaturesStr) {
+  std::unique_ptr<TargetMachine> &Cached = Machines[ModuleTriple.getTriple()];
+  if (!Cached)
+    Cached.reset(GetTargetMachine(ModuleTriple, CPUStr, FeaturesStr,
+                                  InitTargetOptionsFromCodeGenFlags()));
+  return Cached.get();
+}
+
+/// Optimize \p InputFile into \p OutputFile with the pipeline given on the
+/// command line, in a context of its own so that -batch can run several at
+/// once. Target machines come from \p Machines, which belongs to the calling
+/// thread.
+static bool optimizeFile(const char *argv0, const std::string &InputFile,
+                         const std::string &OutputFile,
+                         TargetMachineCache &Machines) {
+  LLVMContext Context;
+  Context.setDiscardValueNames(DiscardValueNames);
+  if (!DisableDITypeMap)
+    Context.enableDebugTypeODRUniquing();
+  if (PassRemarksWithHotness)
+    Context.setDiagnosticHotnessRequested(true);
+
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFile, Err, Context);
+  if (!M) {
+    Err.print(argv0, errs());
+    return false;
+  }
+
+  if (StripDebug)
+    StripDebugInfo(*M);
+
+  if (!NoVerify && verifyModule(*M, &errs())) {
+    errs() << argv0 << ": " << InputFile
+           << ": error: input module is broken!\n";
+    return false;
+  }
+
+  if (!TargetTriple.empty())
+    M->setTargetTriple(Triple::normalize(TargetTriple));
+  if (!ClDataLayout.empty())
+    M->setDataLayout(ClDataLayout);
+
+  std::unique_ptr<tool_output_file> Out;
+  if (!NoOutput) {
+    std::error_code EC;
+    Out = llvm::make_unique<tool_output_file>(OutputFile, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << OutputFile << ": " << EC.message() << '\n';
+      return false;
+    }
+  }
+
+  Triple ModuleTriple(M->getTargetTriple());
+  std::string CPUStr, FeaturesStr;
+  TargetMachine *TM = nullptr;
+  if (ModuleTriple.getArch()) {
+    CPUStr = getCPUStr();
+    FeaturesStr = getFeaturesStr();
+    TM = getCachedTargetMachine(Machines, ModuleTriple, CPUStr, FeaturesStr);
+  }
+  setFunctionAttributes(CPUStr, FeaturesStr, *M);
+
+  // The pass managers are built per module: a FunctionPassManager is tied to
+  // its module and the output pass to its stream.
+  legacy::PassManager Passes;
+  addTargetAnalyses(Passes, ModuleTriple, TM);
+
+  std::unique_ptr<legacy::FunctionPassManager> FPasses;
+  if (hasStandardOptLevel()) {
+    FPasses.reset(new legacy::FunctionPassManager(M.get()));
+    FPasses->add(createTargetTransformInfoWrapperPass(
+        TM ? TM->getTargetIRAnalysis() : TargetIRAnalysis()));
+  }
+
+  addPipelinePasses(argv0, Passes, FPasses.get(), TM, nullptr);
+
+  if (FPasses) {
+    FPasses->doInitialization();
+    for (Function &F : *M)
+      FPasses->run(F);
+    FPasses->doFinalization();
+  }
+
+  if (!NoVerify && !VerifyEach)
+    Passes.add(createVerifierPass());
+
+  if (Out)
+    addOutputPass(Passes, Out->os(), nullptr);
+
+  Passes.run(*M);
+
+  if (Out)
+    Out->keep();
+  return true;
+}
+
+/// Optimize every input/output pair listed in -batch on a pool of threads.
+static bool runBatch(const char *argv0) {
+  if (AnalyzeOnly || PrintBreakpoints || RunTwice ||
+      PassPipeline.getNumOccurrences() || InputFilename.getNumOccurrences() ||
+      !OutputFilename.empty() || !ThinLinkBitcodeFile.empty() ||
+      !RemarksFilename.empty() || !ProfilePassesFilename.empty()) {
+    errs() << argv0 << ": -batch takes its inputs and outputs from the batch "
+           << "file and cannot be used with -analyze, -passes, -o, "
+           << "-thin-link-bitcode-file, -pass-remarks-output, -profile-passes, "
+           << "-print-breakpoints-for-testing or -run-twice\n";
+    return false;
+  }
+
+  auto BufferOrErr = MemoryBuffer::getFile(BatchFilename);
+  if (std::error_code EC = BufferOrErr.getError()) {
+    errs() << argv0 << ": " << BatchFilename << ": " << EC.message() << '\n';
+    return false;
+  }
+
+  // One '<input> <output>' pair per line; blank lines and '#' comments are
+  // skipped.
+  std::vector<std::pair<std::string, std::string>> Jobs;
+  for (line_iterator I(**BufferOrErr, /*SkipBlanks=*/true, '#'); !I.is_at_eof();
+       ++I) {
+    std::pair<StringRef, StringRef> Input = getToken(*I);
+    StringRef Output = getToken(Input.second).first;
+    if (Output.empty() && !NoOutput) {
+      errs() << argv0 << ": " << BatchFilename << ":" << I.line_number()
+             << ": error: expected '<input> <output>'\n";
+      return false;
+    }
+    Jobs.emplace_back(Input.first, Output);
+  }
+
+  // Each worker takes the next job off a shared counter and keeps its own
+  // target machines, so a triple is looked up once per thread rather than
+  // once per module.
+  std::atomic<unsigned> NumFailed(0);
+  std::atomic<size_t> NextJob(0);
+  {
+    unsigned NumThreads = BatchJobs ? unsigned(BatchJobs)
+                                    : heavyweight_hardware_concurrency();
+    ThreadPool Pool(NumThreads);
+    for (unsigned I = 0; I != NumThreads; ++I)
+      Pool.async([&NumFailed, &NextJob, &Jobs, argv0] {
+        TargetMachineCache Machines;
+        for (size_t J = NextJob++; J < Jobs.size(); J = NextJob++)
+          if (!optimizeFile(argv0, Jobs[J].first, Jobs[J].second, Machines))
+            ++NumFailed;
+      });
+  }
+
+  if (NumFailed) {
+    errs() << argv0 << ": " << NumFailed << " of " << Jobs.size()
+           << " modules failed\n";
+    return false;
+  }
+  return true;
+}
+
+/// Run as a compile server on -serve, keeping a target machine per triple.
+static bool runServer(const char *argv0) {
+  TargetMachineCache Machines;
+  auto PrepareModule = [&](Module &M) -> TargetMachine * {
+    if (!TargetTriple.empty())
+      M.setTargetTriple(Triple::normalize(TargetTriple));
+    if (!ClDataLayout.empty())
+      M.setDataLayout(ClDataLayout);
+
+    Triple ModuleTriple(M.getTargetTriple());
+    std::string CPUStr, FeaturesStr;
+    TargetMachine *TM = nullptr;
+    if (ModuleTriple.getArch()) {
+      CPUStr = getCPUStr();
+      FeaturesStr = getFeaturesStr();
+      TM = getCachedTargetMachine(Machines, ModuleTriple, CPUStr, FeaturesStr);
+    }
+    setFunctionAttributes(CPUStr, FeaturesStr, M);
+    return TM;
+  };
+
+  return runCompileServer(argv0, ServeSocket, PrepareModule,
+                          NoVerify ? VK_NoVerifier : VK_VerifyInAndOut,
+                          PreserveBitcodeUseListOrder);
+}
+
 #ifdef LINK_POLLY_INTO_TOOLS
 namespace polly {
 void initializePollyPasses(llvm::PassRegistry &Registry);
@@ -412,6 +784,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (!BatchFilename.empty())
+    return runBatch(argv[0]) ? 0 : 1;
+
+  if (!ServeSocket.empty())
+    return runServer(argv[0]) ? 0 : 1;
+
   SMDiagnostic Err;
 
   Context.setDiscardValueNames(DiscardValueNames);
@@ -536,27 +914,21 @@ int main(int argc, char **argv) {
                : 1;
   }
 
+  std::unique_ptr<PassProfiler> Profiler;
+  if (!ProfilePassesFilename.empty())
+    Profiler = llvm::make_unique<PassProfiler>();
+
   // Create a PassManager to hold and optimize the collection of passes we are
   // about to build.
   //
-  legacy::PassManager Passes;
+  ProfilingPassManager<legacy::PassManager> Passes(Profiler.get());
 
-  // Add an appropriate TargetLibraryInfo pass for the module's triple.
-  TargetLibraryInfoImpl TLII(ModuleTriple);
-
-  // The -disable-simplify-libcalls flag actually disables all builtin optzns.
-  if (DisableSimplifyLibCalls)
-    TLII.disableAllFunctions();
-  Passes.add(new TargetLibraryInfoWrapperPass(TLII));
-
-  // Add internal analysis passes from the target machine.
-  Passes.add(createTargetTransformInfoWrapperPass(TM ? TM->getTargetIRAnalysis()
-                                                     : TargetIRAnalysis()));
+  addTargetAnalyses(Passes, ModuleTriple, TM.get());
 
   std::unique_ptr<legacy::FunctionPassManager> FPasses;
-  if (OptLevelO0 || OptLevelO1 || OptLevelO2 || OptLevelOs || OptLevelOz ||
-      OptLevelO3) {
-    FPasses.reset(new legacy::FunctionPassManager(M.get()));
+  if (hasStandardOptLevel()) {
+    FPasses.reset(new ProfilingPassManager<legacy::FunctionPassManager>(
+        Profiler.get(), M.get()));
     FPasses->add(createTargetTransformInfoWrapperPass(
         TM ? TM->getTargetIRAnalysis() : TargetIRAnalysis()));
   }
@@ -579,108 +951,8 @@ int main(int argc, char **argv) {
     NoOutput = true;
   }
 
-  // Create a new optimization pass for each one specified on the command line
-  for (unsigned i = 0; i < PassList.size(); ++i) {
-    if (StandardLinkOpts &&
-        StandardLinkOpts.getPosition() < PassList.getPosition(i)) {
-      AddStandardLinkPasses(Passes);
-      StandardLinkOpts = false;
-    }
-
-    if (OptLevelO0 && OptLevelO0.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 0, 0);
-      OptLevelO0 = false;
-    }
-
-    if (OptLevelO1 && OptLevelO1.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 1, 0);
-      OptLevelO1 = false;
-    }
-
-    if (OptLevelO2 && OptLevelO2.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 0);
-      OptLevelO2 = false;
-    }
-
-    if (OptLevelOs && OptLevelOs.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 1);
-      OptLevelOs = false;
-    }
-
-    if (OptLevelOz && OptLevelOz.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 2);
-      OptLevelOz = false;
-    }
-
-    if (OptLevelO3 && OptLevelO3.getPosition() < PassList.getPosition(i)) {
-      AddOptimizationPasses(Passes, *FPasses, TM.get(), 3, 0);
-      OptLevelO3 = false;
-    }
-
-    const PassInfo *PassInf = PassList[i];
-    Pass *P = nullptr;
-    if (PassInf->getTargetMachineCtor())
-      P = PassInf->getTargetMachineCtor()(TM.get());
-    else if (PassInf->getNormalCtor())
-      P = PassInf->getNormalCtor()();
-    else
-      errs() << argv[0] << ": cannot create pass: "
-             << PassInf->getPassName() << "\n";
-    if (P) {
-      PassKind Kind = P->getPassKind();
-      addPass(Passes, P);
-
-      if (AnalyzeOnly) {
-        switch (Kind) {
-        case PT_BasicBlock:
-          Passes.add(createBasicBlockPassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        case PT_Region:
-          Passes.add(createRegionPassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        case PT_Loop:
-          Passes.add(createLoopPassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        case PT_Function:
-          Passes.add(createFunctionPassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        case PT_CallGraphSCC:
-          Passes.add(createCallGraphPassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        default:
-          Passes.add(createModulePassPrinter(PassInf, Out->os(), Quiet));
-          break;
-        }
-      }
-    }
-
-    if (PrintEachXForm)
-      Passes.add(
-          createPrintModulePass(errs(), "", PreserveAssemblyUseListOrder));
-  }
-
-  if (StandardLinkOpts) {
-    AddStandardLinkPasses(Passes);
-    StandardLinkOpts = false;
-  }
-
-  if (OptLevelO0)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 0, 0);
-
-  if (OptLevelO1)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 1, 0);
-
-  if (OptLevelO2)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 0);
-
-  if (OptLevelOs)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 1);
-
-  if (OptLevelOz)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 2, 2);
-
-  if (OptLevelO3)
-    AddOptimizationPasses(Passes, *FPasses, TM.get(), 3, 0);
+  addPipelinePasses(argv[0], Passes, FPasses.get(), TM.get(),
+                    AnalyzeOnly ? &Out->os() : nullptr);
 
   if (FPasses) {
     FPasses->doInitialization();
@@ -710,18 +982,7 @@ int main(int argc, char **argv) {
       BOS = make_unique<raw_svector_ostream>(Buffer);
       OS = BOS.get();
     }
-    if (OutputAssembly) {
-      if (EmitSummaryIndex)
-        report_fatal_error("Text output is incompatible with -module-summary");
-      if (EmitModuleHash)
-        report_fatal_error("Text output is incompatible with -module-hash");
-      Passes.add(createPrintModulePass(*OS, "", PreserveAssemblyUseListOrder));
-    } else if (OutputThinLTOBC)
-      Passes.add(createWriteThinLTOBitcodePass(
-          *OS, ThinLinkOut ? &ThinLinkOut->os() : nullptr));
-    else
-      Passes.add(createBitcodeWriterPass(*OS, PreserveBitcodeUseListOrder,
-                                         EmitSummaryIndex, EmitModuleHash));
+    addOutputPass(Passes, *OS, ThinLinkOut ? &ThinLinkOut->os() : nullptr);
   }
 
   // Before executing passes, print the final values of the LLVM options.
@@ -758,6 +1019,17 @@ int main(int argc, char **argv) {
     Out->os() << BOS->str();
   }
 
+  if (Profiler) {
+    std::error_code EC;
+    tool_output_file ProfileOut(ProfilePassesFilename, EC, sys::fs::F_Text);
+    if (EC) {
+      errs() << EC.message() << '\n';
+      return 1;
+    }
+    Profiler->writeTrace(ProfileOut.os());
+    ProfileOut.keep();
+  }
+
   // Declare success.
   if (!NoOutput || PrintBreakpoints)
     Out->keep();
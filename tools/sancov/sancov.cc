@@ -138,17 +138,21 @@ static Regex SymcovFileRegex(".*\\.symcov");
 
 // --------- MAIN DATASTRUCTURES ----------
 
+// A set of addresses, kept as a sorted vector without duplicates. Binaries
+// and .sancov files hold millions of addresses: too many for a tree node each.
+typedef std::vector<uint64_t> AddrSet;
+
 // Contents of .sancov file: list of coverage point addresses that were
 // executed.
 struct RawCoverage {
-  explicit RawCoverage(std::unique_ptr<std::set<uint64_t>> Addrs)
+  explicit RawCoverage(std::unique_ptr<AddrSet> Addrs)
       : Addrs(std::move(Addrs)) {}
 
   // Read binary .sancov file.
   static ErrorOr<std::unique_ptr<RawCoverage>>
   read(const std::string &FileName);
 
-  std::unique_ptr<std::set<uint64_t>> Addrs;
+  std::unique_ptr<AddrSet> Addrs;
 };
 
 // Coverage point has an opaque Id and corresponds to multiple source locations.
@@ -225,13 +229,55 @@ static void failIfEmpty(const std::unique_ptr<T> &Ptr,
   fail(Message);
 }
 
+// ----------- Address sets ----------
+
+// Sort with a least significant digit radix sort, a byte at a time. Bytes
+// which are the same in all addresses, like the high bytes of addresses in a
+// single binary, take a counting pass but no scatter pass.
+static void radixSort(std::vector<uint64_t> &Addrs) {
+  std::vector<uint64_t> Buffer(Addrs.size());
+  for (unsigned Shift = 0; Shift < 64; Shift += 8) {
+    size_t Offsets[256] = {};
+    for (uint64_t Addr : Addrs)
+      ++Offsets[(Addr >> Shift) & 0xff];
+    if (Offsets[(Addrs[0] >> Shift) & 0xff] == Addrs.size())
+      continue;
+
+    size_t Offset = 0;
+    for (size_t &Count : Offsets) {
+      size_t N = Count;
+      Count = Offset;
+      Offset += N;
+    }
+    for (uint64_t Addr : Addrs)
+      Buffer[Offsets[(Addr >> Shift) & 0xff]++] = Addr;
+    Addrs.swap(Buffer);
+  }
+}
+
+// Turn a list of addresses into an AddrSet.
+static void makeAddrSet(std::vector<uint64_t> &Addrs) {
+  // Coverage points are found, and often dumped, in address order.
+  if (!std::is_sorted(Addrs.begin(), Addrs.end())) {
+    if (Addrs.size() < 256)
+      std::sort(Addrs.begin(), Addrs.end());
+    else
+      radixSort(Addrs);
+  }
+  Addrs.erase(std::unique(Addrs.begin(), Addrs.end()), Addrs.end());
+}
+
+static bool contains(const AddrSet &Addrs, uint64_t Addr) {
+  return std::binary_search(Addrs.begin(), Addrs.end(), Addr);
+}
+
 // ----------- Coverage I/O ----------
 template <typename T>
-static void readInts(const char *Start, const char *End,
-                     std::set<uint64_t> *Ints) {
+static void readInts(const char *Start, const char *End, AddrSet *Ints) {
   const T *S = reinterpret_cast<const T *>(Start);
-  const T *E = reinterpret_cast<const T *>(End);
-  std::copy(S, E, std::inserter(*Ints, Ints->end()));
+  const T *E = S + (End - Start) / sizeof(T);
+  Ints->assign(S, E);
+  makeAddrSet(*Ints);
 }
 
 ErrorOr<std::unique_ptr<RawCoverage>>
@@ -253,7 +299,7 @@ RawCoverage::read(const std::string &FileName) {
     return make_error_code(errc::illegal_byte_sequence);
   }
 
-  auto Addrs = llvm::make_unique<std::set<uint64_t>>();
+  auto Addrs = llvm::make_unique<AddrSet>();
 
   switch (Header->Bitness) {
   case Bitness64:
@@ -619,8 +665,7 @@ private:
 
 static std::vector<CoveragePoint>
 getCoveragePoints(const std::string &ObjectFile,
-                  const std::set<uint64_t> &Addrs,
-                  const std::set<uint64_t> &CoveredAddrs) {
+                  const AddrSet &Addrs, const AddrSet &CoveredAddrs) {
   std::vector<CoveragePoint> Result;
   auto Symbolizer(createSymbolizer());
   Blacklists B;
@@ -691,7 +736,7 @@ static bool isCoveragePointSymbol(StringRef Name) {
 
 // Locate __sanitizer_cov* function addresses inside the stubs table on MachO.
 static void findMachOIndirectCovFunctions(const object::MachOObjectFile &O,
-                                          std::set<uint64_t> *Result) {
+                                          std::vector<uint64_t> *Result) {
   MachO::dysymtab_command Dysymtab = O.getDysymtabLoadCommand();
   MachO::symtab_command Symtab = O.getSymtabLoadCommand();
 
@@ -715,7 +760,7 @@ static void findMachOIndirectCovFunctions(const object::MachOObjectFile &O,
               Expected<StringRef> Name = Symbol.getName();
               failIfError(Name);
               if (isCoveragePointSymbol(Name.get())) {
-                Result->insert(Addr);
+                Result->push_back(Addr);
               }
             }
           }
@@ -730,9 +775,8 @@ static void findMachOIndirectCovFunctions(const object::MachOObjectFile &O,
 
 // Locate __sanitizer_cov* function addresses that are used for coverage
 // reporting.
-static std::set<uint64_t>
-findSanitizerCovFunctions(const object::ObjectFile &O) {
-  std::set<uint64_t> Result;
+static AddrSet findSanitizerCovFunctions(const object::ObjectFile &O) {
+  AddrSet Result;
 
   for (const object::SymbolRef &Symbol : O.symbols()) {
     Expected<uint64_t> AddressOrErr = Symbol.getAddress();
@@ -745,7 +789,7 @@ findSanitizerCovFunctions(const object::ObjectFile &O) {
 
     if (!(Symbol.getFlags() & object::BasicSymbolRef::SF_Undefined) &&
         isCoveragePointSymbol(Name)) {
-      Result.insert(Address);
+      Result.push_back(Address);
     }
   }
 
@@ -761,7 +805,7 @@ findSanitizerCovFunctions(const object::ObjectFile &O) {
       failIfError(EC);
 
       if (isCoveragePointSymbol(Name))
-        Result.insert(CO->getImageBase() + RVA);
+        Result.push_back(CO->getImageBase() + RVA);
     }
   }
 
@@ -769,14 +813,15 @@ findSanitizerCovFunctions(const object::ObjectFile &O) {
     findMachOIndirectCovFunctions(*MO, &Result);
   }
 
+  makeAddrSet(Result);
   return Result;
 }
 
 // Locate addresses of all coverage points in a file. Coverage point
 // is defined as the 'address of instruction following __sanitizer_cov
-// call - 1'.
+// call - 1'. The addresses are appended to Addrs in no particular order.
 static void getObjectCoveragePoints(const object::ObjectFile &O,
-                                    std::set<uint64_t> *Addrs) {
+                                    std::vector<uint64_t> *Addrs) {
   Triple TheTriple("unknown-unknown-unknown");
   TheTriple.setArch(Triple::ArchType(O.getArch()));
   auto TripleName = TheTriple.getTriple();
@@ -842,8 +887,8 @@ static void getObjectCoveragePoints(const object::ObjectFile &O,
       uint64_t Target;
       if (MIA->isCall(Inst) &&
           MIA->evaluateBranch(Inst, SectionAddr + Index, Size, Target) &&
-          SanCovAddrs.find(Target) != SanCovAddrs.end())
-        Addrs->insert(CovPoint);
+          contains(SanCovAddrs, Target))
+        Addrs->push_back(CovPoint);
     }
   }
 }
@@ -880,24 +925,25 @@ visitObjectFiles(const std::string &FileName,
     failIfError(object::object_error::invalid_file_type);
 }
 
-static std::set<uint64_t>
-findSanitizerCovFunctions(const std::string &FileName) {
-  std::set<uint64_t> Result;
+static AddrSet findSanitizerCovFunctions(const std::string &FileName) {
+  AddrSet Result;
   visitObjectFiles(FileName, [&](const object::ObjectFile &O) {
     auto Addrs = findSanitizerCovFunctions(O);
-    Result.insert(Addrs.begin(), Addrs.end());
+    Result.insert(Result.end(), Addrs.begin(), Addrs.end());
   });
+  makeAddrSet(Result);
   return Result;
 }
 
 // Locate addresses of all coverage points in a file. Coverage point
 // is defined as the 'address of instruction following __sanitizer_cov
 // call - 1'.
-static std::set<uint64_t> findCoveragePointAddrs(const std::string &FileName) {
-  std::set<uint64_t> Result;
+static AddrSet findCoveragePointAddrs(const std::string &FileName) {
+  AddrSet Result;
   visitObjectFiles(FileName, [&](const object::ObjectFile &O) {
     getObjectCoveragePoints(O, &Result);
   });
+  makeAddrSet(Result);
   return Result;
 }
 
@@ -959,7 +1005,7 @@ symbolize(const RawCoverage &Data, const std::string ObjectFile) {
     Coverage->CoveredIds.insert(utohexstr(Addr, true));
   }
 
-  std::set<uint64_t> AllAddrs = findCoveragePointAddrs(ObjectFile);
+  AddrSet AllAddrs = findCoveragePointAddrs(ObjectFile);
   if (!std::includes(AllAddrs.begin(), AllAddrs.end(), Data.Addrs->begin(),
                      Data.Addrs->end())) {
     fail("Coverage points in binary and .sancov file do not match.");